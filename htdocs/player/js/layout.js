@@ -27,12 +27,19 @@ class UILayout {
             // canvas.height = UILayout.GetVideoHeight(); 
             canvas.style.border = "1px solid black"; 
             canvas.style.cssFloat = "left"; 
+            canvas.style.objectFit = "contain"; 
             this.Container.append(canvas); 
             // var ctx  = canvas.getContext('2d'); 
             // ctx.fillStyle = "gray"; 
             // ctx.fillRect(1, 1, canvas.width, canvas.height);
         }
     } 
+    static SetActive(index, active) {
+        var video = UILayout.Container.children[index];
+        if (video) {
+            video.style.outline = active ? "2px solid #FF8C00" : "none";
+        }
+    }
     static ContainsScreen(num) {
         var screens = [1, 4, 9, 16]; 
         for (var i = 0; i < screens.length; i++) {
@@ -0,0 +1,65 @@
+// 解压服务端LZ4压缩的视频帧（帧头Flags bit0为1时）
+// 格式：原始大小(4) 分块数(2) 保留(2) 每块压缩后大小(4*分块数) 各块数据，整数为大端
+class Lz4Frame {
+    static CHUNK_SIZE = 256 * 1024;
+
+    static decodeBlock(src, dst) {
+        let i = 0;
+        let o = 0;
+        while (i < src.length) {
+            let token = src[i++];
+            let literals = token >> 4;
+            if (literals == 15) {
+                let b;
+                do {
+                    b = src[i++];
+                    literals += b;
+                } while (b == 255);
+            }
+            dst.set(src.subarray(i, i + literals), o);
+            i += literals;
+            o += literals;
+            if (i >= src.length) {
+                break;
+            }
+            let offset = src[i] | (src[i + 1] << 8);
+            i += 2;
+            let match = token & 15;
+            if (match == 15) {
+                let b;
+                do {
+                    b = src[i++];
+                    match += b;
+                } while (b == 255);
+            }
+            match += 4;
+            let from = o - offset;
+            if (offset >= match) {
+                dst.copyWithin(o, from, from + match);
+            } else {
+                for (let k = 0; k < match; k++) {
+                    dst[o + k] = dst[from + k];
+                }
+            }
+            o += match;
+        }
+        return o;
+    }
+
+    // data: 帧头之后的数据，返回解压后的图像数据
+    static decode(data) {
+        let view = new DataView(data.buffer, data.byteOffset, data.byteLength);
+        let rawSize = view.getUint32(0);
+        let chunks = view.getUint16(4);
+        let out = new Uint8Array(rawSize);
+        let pos = 8 + 4 * chunks;
+        for (let i = 0; i < chunks; i++) {
+            let size = view.getUint32(8 + 4 * i);
+            let start = i * Lz4Frame.CHUNK_SIZE;
+            let end = Math.min(start + Lz4Frame.CHUNK_SIZE, rawSize);
+            Lz4Frame.decodeBlock(data.subarray(pos, pos + size), out.subarray(start, end));
+            pos += size;
+        }
+        return out;
+    }
+}
@@ -4,15 +4,40 @@ class WebglScreen2D {
         this.canvas = canvas;
         this.gl = canvas.getContext('2d')
     }
-    renderImg(width, height, data) {
+    // format: 0 NV12, 1 I420, 2 GRAY8, 3 RGBA
+    renderImg(width, height, data, format) {
         this.setSize(width, height);
+        let gl = this.gl;
+        if (format == 3) {
+            gl.putImageData(new ImageData(new Uint8ClampedArray(data.buffer, data.byteOffset, width * height * 4), width, height), 0, 0);
+            return;
+        }
+        if (format == 2) {
+            data = this.grayToI420(width, height, data);
+        }
         // https://developer.mozilla.org/en-US/docs/Web/API/VideoFrame/format
-        const init = {timestamp: 0, codedWidth: width, codedHeight: height, format: 'NV12'};
+        const init = {timestamp: 0, codedWidth: width, codedHeight: height, format: format ? 'I420' : 'NV12'};
         let videoFrame = new VideoFrame(data, init)
-        let gl = this.gl;
         gl.drawImage(videoFrame, 0, 0, width, height);
         videoFrame.close();
     }
+    // 灰度图补上中性色度平面
+    grayToI420(width, height, data) {
+        let ySize = width * height;
+        let size = ySize + 2 * ((width + 1) >> 1) * ((height + 1) >> 1);
+        if (!this.grayBuffer || this.grayBuffer.length != size) {
+            this.grayBuffer = new Uint8Array(size);
+            this.grayBuffer.fill(128, ySize);
+        }
+        this.grayBuffer.set(data.subarray(0, ySize));
+        return this.grayBuffer;
+    }
+    // VideoFrame decoded by WebCodecs, closed here
+    renderFrame(videoFrame) {
+        this.setSize(videoFrame.displayWidth, videoFrame.displayHeight);
+        this.gl.drawImage(videoFrame, 0, 0, videoFrame.displayWidth, videoFrame.displayHeight);
+        videoFrame.close();
+    }
     setSize(width, height) {
         this.canvas.width = width;
         this.canvas.height = height;
@@ -14,9 +14,45 @@ class webSocketClient {
         this.callback = callback;
         this.ws = null;
         this.yuvPlayer = null;
-        this.avRawHeaderSize = 8;
+        this.avRawHeaderSize = 12;
+        this.outputFormat = 0;  // 0: NV12, 1: I420, 2: GRAY8, 3: RGBA
+        this.compress = 0;      // 1: 服务端LZ4无损压缩，适合远程访问
+        this.delta = 0;         // 16/64: 只传输变化的块（块大小），适合静止画面较多的场景
+        this.deltaRef = null;   // 增量帧的参考帧
+        this.motion = 0;        // 1: 画面静止时服务端降低帧率（idleFps帧/秒）
+        this.idleFps = 1;
+        this.avPacketHeaderSize = 14;
+        this.outputMode = 0;    // 0: 服务端解码(NV12)，1: 浏览器解码(WebCodecs)，2: 服务端转码H.264后浏览器解码
+        this.decoder = null;
+        this.decoderCodec = null;
+        this.fitMode = 1;   // 0: stretch, 1: contain, 2: cover
+        this.playing = false;
+        this.resizeTimer = null;
 
         this.checkInit();
+        this.observeResize();
+    }
+
+    // 画布大小变化时通知服务端，按实际显示尺寸输出
+    observeResize() {
+        if (typeof ResizeObserver === 'undefined') {
+            return;
+        }
+        let that = this;
+        new ResizeObserver(function () {
+            if (!that.playing) {
+                return;
+            }
+            clearTimeout(that.resizeTimer);
+            that.resizeTimer = setTimeout(function () {
+                that.doResize();
+            }, 200);
+        }).observe(this.canvas);
+    }
+
+    canvasSize() {
+        let ratio = window.devicePixelRatio || 1;
+        return [Math.round(this.canvas.clientWidth * ratio), Math.round(this.canvas.clientHeight * ratio)];
     }
 
     initYuvPlayer(w, h, canvas) {
@@ -64,33 +100,162 @@ class webSocketClient {
         }
     }
 
+    // 透传模式：Annex-B码流，用WebCodecs解码
+    onPacket(data) {
+        let header = new Uint8Array(data, 0, this.avPacketHeaderSize);
+        let w = (header[0] << 8) + header[1];
+        let h = (header[2] << 8) + header[3];
+        let view = new DataView(data);
+        let pts = view.getUint32(4);
+        let key = (header[12] & 0x1) != 0;
+        let codecSize = header[13];
+        let codec = String.fromCharCode.apply(null, new Uint8Array(data, this.avPacketHeaderSize, codecSize));
+        if (this.callback) {
+            this.callback(this.index, w, h, pts);
+        }
+
+        let that = this;
+        if (this.decoder == null || this.decoderCodec != codec) {
+            // 需要从关键帧开始解码
+            if (!key) {
+                return;
+            }
+            if (this.decoder) {
+                this.decoder.close();
+            }
+            this.decoder = new VideoDecoder({
+                output: function (frame) {
+                    if (that.yuvPlayer) {
+                        that.yuvPlayer.renderFrame(frame);
+                    } else {
+                        frame.close();
+                    }
+                },
+                error: function (e) {
+                    that.showToast("decode error: " + e.message);
+                    that.decoder = null;
+                }
+            });
+            this.decoder.configure({codec: codec, codedWidth: w, codedHeight: h, optimizeForLatency: true});
+            this.decoderCodec = codec;
+        }
+        this.decoder.decode(new EncodedVideoChunk({
+            type: key ? "key" : "delta",
+            timestamp: pts * 1000,
+            data: new Uint8Array(data, this.avPacketHeaderSize + codecSize)
+        }));
+    }
+
+    closeDecoder() {
+        if (this.decoder && this.decoder.state != "closed") {
+            this.decoder.close();
+        }
+        this.decoder = null;
+        this.decoderCodec = null;
+    }
+
     onMessage(event) {
         let that = this;
         let data = event.data;
-        if (typeof data !== 'string') {
+        if (typeof data !== 'string' && that.outputMode != 0) {
+            that.onPacket(data);
+        } else if (typeof data !== 'string') {
             let header = new Uint8Array(data, 0, that.avRawHeaderSize);
             let w = (header[0] << 8) + header[1];
             let h = (header[2] << 8) + header[3];
-            let ts = (header[4] << 24) + (header[5] << 16) + (header[6] << 8) + header[7];
+            let ts = ((header[4] << 24) >>> 0) + (header[5] << 16) + (header[6] << 8) + header[7];
+            let format = header[8];
+            let flags = header[9];
+            let motion = header[10];    // 画面变化程度0~100
             if (that.callback) {
-                that.callback(that.index, w, h, ts);
+                that.callback(that.index, w, h, ts, motion);
             }
-            // video-yuv420P
             if (that.yuvPlayer == null) {
                 return;
             }
-            that.yuvPlayer.renderImg(w, h, new Uint8Array(data, that.avRawHeaderSize, w * h * 3 / 2));
+            let image = new Uint8Array(data, that.avRawHeaderSize);
+            if (flags & 0x1) {
+                image = Lz4Frame.decode(image);
+            }
+            if (flags & 0x2) {
+                image = that.applyDelta(w, h, format, image);
+                if (image == null) {
+                    return;
+                }
+            } else if (that.delta) {
+                that.deltaRef = image;
+            }
+            that.yuvPlayer.renderImg(w, h, image, format);
         } else {
             const payload = JSON.parse(data);
             if (payload.type == 5) {
                 that.showToast("version: " + payload.version);
             }
+            if (payload.type == 9 && payload.result == 0) {
+                that.saveSnapshot(payload.mime, payload.image);
+            }
+            if (payload.type == 10 && payload.result == 0) {
+                that.showToast("recording: " + payload.replay);
+            }
             if (payload.result != 0) {
                 that.showToast("[" + payload.result + "]" + payload.message);
             }
         }
     }
 
+    // 每个平面：[每像素字节数, 水平下采样位移, 垂直下采样位移]，与服务端DeltaEncoder一致
+    static deltaPlanes(format) {
+        switch (format) {
+            case 0: return [[1, 0, 0], [2, 1, 1]];
+            case 1: return [[1, 0, 0], [1, 1, 1], [1, 1, 1]];
+            case 2: return [[1, 0, 0]];
+            case 3: return [[4, 0, 0]];
+        }
+        return null;
+    }
+
+    // 把变化的块写入参考帧，参考帧缺失或尺寸不符时请求完整帧
+    applyDelta(w, h, format, delta) {
+        const ceilShift = (v, s) => (v + (1 << s) - 1) >> s;
+        let planes = webSocketClient.deltaPlanes(format);
+        let ref = this.deltaRef;
+        let size = 0;
+        if (planes) {
+            for (const [bpp, sx, sy] of planes) {
+                size += bpp * ceilShift(w, sx) * ceilShift(h, sy);
+            }
+        }
+        if (!planes || ref == null || ref.length != size) {
+            this.deltaRef = null;
+            this.doResync();
+            return null;
+        }
+
+        let blockSize = (delta[0] << 8) + delta[1];
+        let cols = (delta[2] << 8) + delta[3];
+        let rows = (delta[4] << 8) + delta[5];
+        let bitmap = 8;
+        let pos = bitmap + ((cols * rows + 7) >> 3);
+        for (let i = 0; i < cols * rows; i++) {
+            if (!(delta[bitmap + (i >> 3)] & (1 << (i & 7)))) {
+                continue;
+            }
+            let x0 = (i % cols) * blockSize, y0 = Math.floor(i / cols) * blockSize;
+            let x1 = Math.min(x0 + blockSize, w), y1 = Math.min(y0 + blockSize, h);
+            let offset = 0;
+            for (const [bpp, sx, sy] of planes) {
+                let linesize = bpp * ceilShift(w, sx);
+                let col0 = bpp * ceilShift(x0, sx), n = bpp * ceilShift(x1, sx) - col0;
+                for (let y = ceilShift(y0, sy); y < ceilShift(y1, sy); y++) {
+                    ref.set(delta.subarray(pos, pos + n), offset + y * linesize + col0);
+                    pos += n;
+                }
+                offset += linesize * ceilShift(h, sy);
+            }
+        }
+        return ref;
+    }
+
     doSendMessage(msg) {
         if (this.ws && this.ws.readyState === 1) {
             this.ws.send(msg);
@@ -101,19 +266,32 @@ class webSocketClient {
     }
 
     /* Player controls Start Here */
-    doPlay(mediaUrl, gpu) {
+    doPlay(mediaUrl, gpu, mode) {
         this.checkInit();
 
+        // 浏览器不支持WebCodecs时退回服务端解码
+        this.outputMode = (mode > 0 && typeof VideoDecoder !== 'undefined') ? mode : 0;
+        this.closeDecoder();
+        this.deltaRef = null;
+        let size = this.canvasSize();
         var dataJson = {
             "type": 1,
             "param": {
                 "url": mediaUrl,
                 "use_gpu": gpu,
-                "width": 1,
-                "height": 1
+                "width": size[0],
+                "height": size[1],
+                "fit": this.fitMode,
+                "mode": this.outputMode,
+                "format": this.outputFormat,
+                "compress": this.compress,
+                "delta": this.delta,
+                "motion": this.motion,
+                "idle_fps": this.idleFps
             }
         }
         this.doSendMessage(JSON.stringify(dataJson));
+        this.playing = true;
     }
     doStop() {
         let that = this;
@@ -121,6 +299,8 @@ class webSocketClient {
             "type": 2,
         }
         that.doSendMessage(JSON.stringify(dataJson));
+        that.playing = false;
+        that.closeDecoder();
 
         if (that.yuvPlayer) {
             that.yuvPlayer.destroy();
@@ -139,6 +319,178 @@ class webSocketClient {
         }
         this.doSendMessage(JSON.stringify(dataJson));
     }
+    // 服务端合成：多路视频合成到一个画面中，只占用一个WebGL Context
+    doPlayMosaic(mediaUrls, layout, gpu) {
+        this.checkInit();
+
+        let size = this.canvasSize();
+        var dataJson = {
+            "type": 7,
+            "param": {
+                "urls": mediaUrls,
+                "layout": layout,
+                "use_gpu": gpu,
+                "width": size[0],
+                "height": size[1]
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    doResize() {
+        this.checkInit();
+
+        let size = this.canvasSize();
+        var dataJson = {
+            "type": 3,
+            "param": {
+                "width": size[0],
+                "height": size[1],
+                "fit": this.fitMode
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 放大画面的某个区域，参数为占原始画面的比例（0~1），width或height为0时恢复全画面
+    doSetCrop(x, y, width, height) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 6,
+            "param": {
+                "x": x,
+                "y": y,
+                "width": width,
+                "height": height
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 截图：返回最新解码的一帧，format为"jpeg"或"png"，宽高为0时保持原始比例
+    doSnapshot(format, width, height) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 9,
+            "param": {
+                "format": format,
+                "width": width,
+                "height": height
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    saveSnapshot(mime, image) {
+        let link = document.createElement('a');
+        link.href = "data:" + mime + ";base64," + image;
+        link.download = "snapshot_" + this.index + (mime == "image/png" ? ".png" : ".jpg");
+        link.click();
+    }
+    // 开始录像，name为录像目录名，为空时由服务端生成
+    doStartRecord(name) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 10,
+            "param": {
+                "name": name
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    doStopRecord() {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 11,
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    doPause() {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 12,
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    doResume() {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 13,
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 跳转到指定位置(毫秒)，仅文件和录像回放
+    doSeek(position) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 14,
+            "param": {
+                "position": position
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 拖动进度条时预览，只解码每个位置的关键帧；松开时done为1，从该位置继续播放
+    doScrub(position, done) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 15,
+            "param": {
+                "position": position,
+                "done": done ? 1 : 0
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 播放速率0.25~16，仅文件和录像回放
+    doSetRate(rate) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 16,
+            "param": {
+                "rate": rate
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 不停止播放切换到另一个地址，新地址就绪前继续播放当前画面
+    doSwitch(url, useTcp) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 17,
+            "param": {
+                "url": url,
+                "use_tcp": useTcp === undefined ? 1 : useTcp
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 预先打开即将播放的地址（如轮巡的下一组），之后播放或切换到这些地址时立即出图
+    doPreload(urls, useTcp) {
+        this.checkInit();
+
+        var dataJson = {
+            "type": 18,
+            "param": {
+                "urls": urls,
+                "use_tcp": useTcp === undefined ? 1 : useTcp
+            }
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
+    // 要求服务端下一帧发送完整帧
+    doResync() {
+        var dataJson = {
+            "type": 8,
+        }
+        this.doSendMessage(JSON.stringify(dataJson));
+    }
     doDiscardFrames(value) {
         this.checkInit();
 
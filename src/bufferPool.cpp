@@ -0,0 +1,53 @@
+#include "bufferPool.h"
+
+// small payloads (signaling, control frames) are cheaper to allocate than to pool
+constexpr size_t BUFFER_POOL_MIN_SIZE = 64 * 1024;
+constexpr size_t BUFFER_POOL_MAX_IDLE_BYTES = 256 * 1024 * 1024;
+constexpr size_t BUFFER_POOL_MAX_IDLE_COUNT = 64;
+
+BufferPool &BufferPool::GetInstance() {
+    static BufferPool instance;
+    return instance;
+}
+
+BufferPool::BufferPool() : free_bytes_(0) {
+}
+
+std::string BufferPool::acquire(size_t size) {
+    std::string buf;
+    if (size >= BUFFER_POOL_MIN_SIZE) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        // best fit, so that a 4K buffer is not burnt on a thumbnail
+        auto best = free_list_.end();
+        for (auto it = free_list_.begin(); it != free_list_.end(); ++it) {
+            if (it->capacity() >= size && (best == free_list_.end() || it->capacity() < best->capacity())) {
+                best = it;
+            }
+        }
+        if (best != free_list_.end()) {
+            free_bytes_ -= best->capacity();
+            buf.swap(*best);
+            free_list_.erase(best);
+        }
+    }
+
+    // released strings keep their length, so shrinking or reusing the same size
+    // does not touch the payload bytes.
+    buf.resize(size);
+    return buf;
+}
+
+void BufferPool::release(std::string &&buf) {
+    size_t capacity = buf.capacity();
+    if (capacity < BUFFER_POOL_MIN_SIZE) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (free_list_.size() >= BUFFER_POOL_MAX_IDLE_COUNT ||
+        free_bytes_ + capacity > BUFFER_POOL_MAX_IDLE_BYTES) {
+        return;
+    }
+    free_bytes_ += capacity;
+    free_list_.emplace_back(std::move(buf));
+}
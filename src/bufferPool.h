@@ -0,0 +1,31 @@
+#ifndef __BUFFER_POOL_H__
+#define __BUFFER_POOL_H__
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Recycles the payload storage of video messages. A frame is written once into
+// a pooled string, the string is moved into a websocket message, and its storage
+// comes back here once the connection has written and released that message.
+class BufferPool {
+public:
+    static BufferPool &GetInstance();
+
+    virtual ~BufferPool() = default;
+
+    // returns a string of exactly size bytes, reusing released storage when possible.
+    std::string acquire(size_t size);
+
+    void release(std::string &&buf);
+
+private:
+    BufferPool();
+
+private:
+    std::mutex mutex_;
+    std::vector<std::string> free_list_;
+    size_t free_bytes_;
+};
+
+#endif // __BUFFER_POOL_H__
@@ -5,8 +5,24 @@
 #include <fstream>
 
 constexpr auto SERVICE_PORT_DEFAULT = (30060);
+constexpr auto SLICE_SCALE_PIXELS_DEFAULT = (1920 * 1080);
+constexpr auto GOP_CACHE_BYTES_DEFAULT = (8 * 1024 * 1024);
+constexpr auto RECORD_PATH_DEFAULT = "record";
+constexpr auto INPUT_QUEUE_BYTES_DEFAULT = (8 * 1024 * 1024);
+constexpr auto STANDBY_INPUTS_DEFAULT = (4);
+constexpr auto STANDBY_BYTES_DEFAULT = (32 * 1024 * 1024);
+constexpr auto OPEN_TIMEOUT_MS_DEFAULT = (5000);
+constexpr auto PROBE_TIMEOUT_MS_DEFAULT = (10000);
+constexpr auto READ_TIMEOUT_MS_DEFAULT = (1500);
 
-SysConfig::SysConfig() : servicePort(SERVICE_PORT_DEFAULT), logLevel(3) {
+SysConfig::SysConfig() : servicePort(SERVICE_PORT_DEFAULT), logLevel(3), workerThreads(0),
+                         sliceScalePixels(SLICE_SCALE_PIXELS_DEFAULT), gopCacheBytes(GOP_CACHE_BYTES_DEFAULT),
+                         recordPath(RECORD_PATH_DEFAULT), inputQueueBytes(INPUT_QUEUE_BYTES_DEFAULT),
+                         inputOptions({ { "buffer_size", "4194304" }, { "recv_buffer_size", "4194304" },
+                                        { "reorder_queue_size", "500" } }),
+                         standbyInputs(STANDBY_INPUTS_DEFAULT), standbyBytes(STANDBY_BYTES_DEFAULT),
+                         openTimeoutMs(OPEN_TIMEOUT_MS_DEFAULT), probeTimeoutMs(PROBE_TIMEOUT_MS_DEFAULT),
+                         readTimeoutMs(READ_TIMEOUT_MS_DEFAULT) {
     start();
 }
 
@@ -25,6 +41,23 @@ int SysConfig::start() {
         }
         servicePort = root["servicePort"].asInt();
         logLevel = root["logLevel"].asInt();
+        workerThreads = root.get("workerThreads", workerThreads).asInt();
+        sliceScalePixels = root.get("sliceScalePixels", sliceScalePixels).asInt();
+        gopCacheBytes = root.get("gopCacheBytes", gopCacheBytes).asInt();
+        recordPath = root.get("recordPath", recordPath).asString();
+        inputQueueBytes = root.get("inputQueueBytes", inputQueueBytes).asInt();
+        standbyInputs = root.get("standbyInputs", standbyInputs).asInt();
+        standbyBytes = root.get("standbyBytes", standbyBytes).asInt();
+        openTimeoutMs = root.get("openTimeoutMs", openTimeoutMs).asInt();
+        probeTimeoutMs = root.get("probeTimeoutMs", probeTimeoutMs).asInt();
+        readTimeoutMs = root.get("readTimeoutMs", readTimeoutMs).asInt();
+        const Json::Value &options = root["inputOptions"];
+        if (options.isObject()) {
+            inputOptions.clear();
+            for (const auto &name : options.getMemberNames()) {
+                inputOptions[name] = options[name].asString();
+            }
+        }
     }
     catch (Json::Exception &e) {
         return InvalidJson;
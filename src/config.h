@@ -1,6 +1,9 @@
 #ifndef __HPP_CONFIG_H__
 #define __HPP_CONFIG_H__
 
+#include <map>
+#include <string>
+
 class SysConfig {
 public:
     SysConfig();
@@ -12,6 +15,17 @@ public:
 public:
     int servicePort;
     int logLevel;
+    int workerThreads;      // shared worker pool size, 0 means one per CPU core
+    int sliceScalePixels;   // output frames with at least this many pixels are scaled in slices
+    int gopCacheBytes;      // per live url, packets from the last keyframe on, 0 disables the cache
+    std::string recordPath; // recordings are written to a directory per recording below it
+    int inputQueueBytes;    // packets of a live input read ahead of decoding, whole GOPs are dropped beyond
+    std::map<std::string, std::string> inputOptions;   // demuxer/protocol options of network inputs
+    int standbyInputs;      // preloaded inputs kept open at most, 0 disables preloading
+    int standbyBytes;       // packets buffered by all preloaded inputs together
+    int openTimeoutMs;      // I/O budgets of an input per operation, see IoDeadline. 0: no limit
+    int probeTimeoutMs;
+    int readTimeoutMs;
 };
 
 extern SysConfig *gConfig;
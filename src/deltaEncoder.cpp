@@ -0,0 +1,194 @@
+#include "deltaEncoder.h"
+#include <cstring>
+#include "bufferPool.h"
+
+extern "C" {
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+}
+
+constexpr int DELTA_HEADER_SIZE = 8;
+// above this share of the full frame a delta saves too little, the full frame also resets drift
+constexpr double DELTA_MAX_SHARE = 0.5;
+
+static inline int ceil_shift(int value, int shift) {
+    return (value + (1 << shift) - 1) >> shift;
+}
+
+DeltaEncoder::DeltaEncoder(int block_size, int threshold, int full_interval) :
+        block_size_(block_size), threshold_(threshold), full_interval_(full_interval), frames_since_full_(0),
+        full_request_(true), width_(0), height_(0), format_(AV_PIX_FMT_NONE), columns_(0), rows_(0),
+        sad_fn_(nullptr), sad_size_(0) {
+    // pixelutils has kernels up to 32x32, bigger blocks are summed from those
+    int bits = av_log2(block_size_);
+    int sad_bits = FFMIN(bits, 5);
+    sad_fn_ = av_pixelutils_get_sad_fn(sad_bits, sad_bits, 0, nullptr);
+    sad_size_ = 1 << sad_bits;
+}
+
+void DeltaEncoder::requestFull() {
+    full_request_ = true;
+}
+
+// plane geometry must match what the client computes, see the layout in the header
+bool DeltaEncoder::setup_geometry(int width, int height, enum AVPixelFormat format) {
+    if (width == width_ && height == height_ && format == format_) {
+        return true;
+    }
+
+    planes_.clear();
+    switch (format) {
+    case AV_PIX_FMT_NV12:
+        planes_ = { { 1, 0, 0, 0, 0 }, { 2, 1, 1, 0, 0 } };
+        break;
+    case AV_PIX_FMT_YUV420P:
+        planes_ = { { 1, 0, 0, 0, 0 }, { 1, 1, 1, 0, 0 }, { 1, 1, 1, 0, 0 } };
+        break;
+    case AV_PIX_FMT_GRAY8:
+        planes_ = { { 1, 0, 0, 0, 0 } };
+        break;
+    case AV_PIX_FMT_RGBA:
+        planes_ = { { 4, 0, 0, 0, 0 } };
+        break;
+    default:
+        return false;
+    }
+
+    int offset = 0;
+    for (Plane &plane : planes_) {
+        plane.offset = offset;
+        plane.linesize = plane.bytes_per_pixel * ceil_shift(width, plane.shift_x);
+        offset += plane.linesize * ceil_shift(height, plane.shift_y);
+    }
+
+    width_ = width;
+    height_ = height;
+    format_ = format;
+    columns_ = (width + block_size_ - 1) / block_size_;
+    rows_ = (height + block_size_ - 1) / block_size_;
+    reference_.clear();
+    return true;
+}
+
+bool DeltaEncoder::block_changed(const uint8_t *payload, int bx, int by) const {
+    int x0 = bx * block_size_;
+    int y0 = by * block_size_;
+    int x1 = FFMIN(x0 + block_size_, width_);
+    int y1 = FFMIN(y0 + block_size_, height_);
+
+    for (size_t p = 0; p < planes_.size(); p++) {
+        const Plane &plane = planes_[p];
+        int col0 = plane.bytes_per_pixel * ceil_shift(x0, plane.shift_x);
+        int col1 = plane.bytes_per_pixel * ceil_shift(x1, plane.shift_x);
+        int row0 = ceil_shift(y0, plane.shift_y);
+        int row1 = ceil_shift(y1, plane.shift_y);
+        const uint8_t *cur = payload + plane.offset + (size_t)row0 * plane.linesize + col0;
+        const uint8_t *ref = reference_.data() + plane.offset + (size_t)row0 * plane.linesize + col0;
+        int64_t limit = (int64_t)threshold_ * (col1 - col0) * (row1 - row0);
+        int64_t sad = 0;
+
+        // whole luma blocks take the SIMD kernels
+        if (p == 0 && plane.bytes_per_pixel == 1 && sad_fn_ &&
+            x1 - x0 == block_size_ && y1 - y0 == block_size_) {
+            for (int y = 0; y < block_size_ && sad <= limit; y += sad_size_) {
+                for (int x = 0; x < block_size_; x += sad_size_) {
+                    sad += sad_fn_(cur + (size_t)y * plane.linesize + x, plane.linesize,
+                                   ref + (size_t)y * plane.linesize + x, plane.linesize);
+                }
+            }
+        } else {
+            for (int y = 0; y < row1 - row0 && sad <= limit; y++) {
+                const uint8_t *c = cur + (size_t)y * plane.linesize;
+                const uint8_t *r = ref + (size_t)y * plane.linesize;
+                for (int x = 0; x < col1 - col0; x++) {
+                    sad += FFABS(c[x] - r[x]);
+                }
+            }
+        }
+        if (sad > limit) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DeltaEncoder::set_reference(const uint8_t *payload, int size) {
+    reference_.assign(payload, payload + size);
+    frames_since_full_ = 0;
+}
+
+bool DeltaEncoder::encode(const uint8_t *payload, int size, int width, int height, enum AVPixelFormat format,
+                          int header_size, std::string *out) {
+    if (!setup_geometry(width, height, format)) {
+        return false;
+    }
+    if (full_request_.exchange(false) || reference_.size() != (size_t)size ||
+        ++frames_since_full_ >= full_interval_) {
+        set_reference(payload, size);
+        return false;
+    }
+
+    // bytes of one block in one plane, edge blocks are smaller
+    auto block_rect = [this](const Plane &plane, int bx, int by, int *col0, int *row0, int *cols, int *rows) {
+        int x0 = bx * block_size_;
+        int y0 = by * block_size_;
+        int x1 = FFMIN(x0 + block_size_, width_);
+        int y1 = FFMIN(y0 + block_size_, height_);
+        *col0 = plane.bytes_per_pixel * ceil_shift(x0, plane.shift_x);
+        *cols = plane.bytes_per_pixel * ceil_shift(x1, plane.shift_x) - *col0;
+        *row0 = ceil_shift(y0, plane.shift_y);
+        *rows = ceil_shift(y1, plane.shift_y) - *row0;
+    };
+
+    int blocks = columns_ * rows_;
+    int bitmap_size = (blocks + 7) / 8;
+    std::vector<int> changed;
+    size_t data_size = 0;
+    for (int by = 0; by < rows_; by++) {
+        for (int bx = 0; bx < columns_; bx++) {
+            if (!block_changed(payload, bx, by)) {
+                continue;
+            }
+            changed.push_back(by * columns_ + bx);
+            for (const Plane &plane : planes_) {
+                int col0, row0, cols, rows;
+                block_rect(plane, bx, by, &col0, &row0, &cols, &rows);
+                data_size += (size_t)cols * rows;
+            }
+        }
+    }
+
+    size_t delta_size = DELTA_HEADER_SIZE + bitmap_size + data_size;
+    if (delta_size > size * DELTA_MAX_SHARE) {
+        set_reference(payload, size);
+        return false;
+    }
+
+    *out = BufferPool::GetInstance().acquire(header_size + delta_size);
+    uint8_t *base = (uint8_t *) &(*out)[0] + header_size;
+    AV_WB16(base, block_size_);
+    AV_WB16(base + 2, columns_);
+    AV_WB16(base + 4, rows_);
+    AV_WB16(base + 6, 0);
+    uint8_t *bitmap = base + DELTA_HEADER_SIZE;
+    memset(bitmap, 0, bitmap_size);
+
+    uint8_t *op = bitmap + bitmap_size;
+    for (int index : changed) {
+        bitmap[index >> 3] |= (uint8_t)(1 << (index & 7));
+        int bx = index % columns_;
+        int by = index / columns_;
+        for (const Plane &plane : planes_) {
+            int col0, row0, cols, rows;
+            block_rect(plane, bx, by, &col0, &row0, &cols, &rows);
+            size_t start = plane.offset + (size_t)row0 * plane.linesize + col0;
+            for (int y = 0; y < rows; y++) {
+                size_t pos = start + (size_t)y * plane.linesize;
+                memcpy(op, payload + pos, cols);
+                memcpy(reference_.data() + pos, payload + pos, cols);
+                op += cols;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+#ifndef __DELTA_ENCODER_H__
+#define __DELTA_ENCODER_H__
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/pixfmt.h>
+#include <libavutil/pixelutils.h>
+}
+
+// Sends only the blocks of a frame that changed since the last frame the client has.
+// The frame is divided into square blocks on the luma grid, each block is compared against
+// a reference copy of what the client shows (SIMD SAD from pixelutils on the luma plane),
+// and changed blocks go out with a bitmap. The reference only takes the blocks that were
+// sent, so small differences below the threshold never accumulate on the client.
+//
+// delta payload layout:
+// block size(2) columns(2) rows(2) reserved(2) bitmap(ceil(columns * rows / 8)) blocks...
+// bit (i & 7) of bitmap byte i / 8 marks block i in raster order. Every changed block is
+// stored plane by plane, row by row, covering the block's bytes in each plane.
+class DeltaEncoder {
+public:
+    DeltaEncoder(int block_size, int threshold, int full_interval);
+
+    virtual ~DeltaEncoder() = default;
+
+    // payload holds the complete converted frame. returns true with out = header_size reserved
+    // bytes followed by the delta payload, false when the complete frame has to be sent (first
+    // frame, geometry change, periodic refresh, resync request or too much changed).
+    bool encode(const uint8_t *payload, int size, int width, int height, enum AVPixelFormat format,
+                int header_size, std::string *out);
+
+    // the next frame goes out complete, may be called from any thread
+    void requestFull();
+
+private:
+    struct Plane {
+        int bytes_per_pixel;
+        int shift_x;
+        int shift_y;
+        int offset;
+        int linesize;
+    };
+
+    bool setup_geometry(int width, int height, enum AVPixelFormat format);
+
+    bool block_changed(const uint8_t *payload, int bx, int by) const;
+
+    void set_reference(const uint8_t *payload, int size);
+
+private:
+    int block_size_;
+    int threshold_;
+    int full_interval_;
+    int frames_since_full_;
+    std::atomic<bool> full_request_;
+
+    int width_;
+    int height_;
+    enum AVPixelFormat format_;
+    int columns_;
+    int rows_;
+    std::vector<Plane> planes_;
+    std::vector<uint8_t> reference_;
+
+    av_pixelutils_sad_fn sad_fn_;
+    int sad_size_;
+};
+
+#endif // __DELTA_ENCODER_H__
@@ -9,6 +9,7 @@ typedef struct error_msg {
 const ERROR_MSG g_ErrorMsg[] = {
         {NoneError,            "Success"},
         {InvalidJson,          "Invalid Json"},
+        {InvalidParameter,     "Invalid Parameter"},
         {NotSupport,           "Request Not Support"},
         {InvalidUrl,           "Invalid Video Url"},
         {InvalidResolution,    "Invalid Video Resolution"},
@@ -17,6 +18,8 @@ const ERROR_MSG g_ErrorMsg[] = {
         {PlayVideoError,       "Play Video Error"},
 
         {FFOpenUrlFailed,      "Could not open source file "},
+        {FFEncoderNotFound,    "No H.264 encoder available (libx264 or libopenh264)"},
+        {FFNoFrameDecoded,     "No frame decoded yet"},
 
         {WSSendBufferOverflow, "send buffer overflow, check CPU please."},
 
@@ -17,6 +17,8 @@ typedef enum error_type {
     PlayVideoError,
 
     FFOpenUrlFailed = 201,
+    FFEncoderNotFound,
+    FFNoFrameDecoded,
 
     WSSendBufferOverflow = 301,
 
@@ -2,7 +2,12 @@
 #include "ffmpegWrapper.h"
 #include <thread>         // std::this_thread::sleep_for
 #include <chrono>         // std::chrono::seconds
+#include <cmath>          // std::isfinite
 #include "error.h"
+#include "threadPool.h"
+#include "gopCache.h"
+#include "bufferPool.h"
+#include "pixelKernels.h"
 
 
 #include <config.h>
@@ -11,26 +16,55 @@
 #pragma warning (disable: 4819)
 #pragma warning (disable: 26812)
 
-constexpr enum AVPixelFormat TARGET_PIX_FMT = AV_PIX_FMT_NV12;//  AV_PIX_FMT_YUV420P;
 constexpr int HPP_HEADER_SIZE = 8;
+// width(2) height(2) timestamp(4) format(1) flags(1) reserved(2)
+constexpr int HPP_HEADER_V2_SIZE = 12;
+// flags of the extended header
+constexpr uint8_t HPP_FLAG_LZ4 = 0x1;
+constexpr uint8_t HPP_FLAG_DELTA = 0x2;
+constexpr int DELTA_THRESHOLD_DEFAULT = 2;
+constexpr int DELTA_INTERVAL_DEFAULT = 250;
+constexpr int MOTION_THRESHOLD_DEFAULT = 1;
+// indexed by OutputFormat
+constexpr enum AVPixelFormat OUTPUT_PIX_FMTS[] = {
+    AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P, AV_PIX_FMT_GRAY8, AV_PIX_FMT_RGBA
+};
+// width(2) height(2) pts(4) dts(4) flags(1) codec length(1), followed by the codec string
+constexpr int HPP_PACKET_HEADER_SIZE = 14;
+constexpr uint8_t HPP_PACKET_FLAG_KEY = 0x1;
+
+constexpr int ENCODE_BITRATE_DEFAULT = 1500;        // kbps
+constexpr int ENCODE_GOP_DEFAULT = 50;
+constexpr const char *ENCODE_PRESET_DEFAULT = "ultrafast";
+// one extra encoder thread per this many output pixels, at most ENCODE_THREADS_MAX in total
+constexpr int ENCODE_PIXELS_PER_THREAD = 1280 * 720;
+constexpr int ENCODE_THREADS_MAX = 4;
 constexpr int DISCARD_FRAME_FREQUENCY = 2;
+constexpr int FRAME_RATE_DEFAULT = 25;
 constexpr int MAX_PACKET_VIDEO = 10;
 constexpr int MAX_PACKET_AUDIO = 30;
+// live inputs read ahead of decoding, audio is bounded by packets since it is small
+constexpr int MAX_PACKET_AUDIO_LIVE = 500;
+constexpr double RATE_MIN = 0.25;
+constexpr double RATE_MAX = 16.0;
+// faster than this non-reference frames are skipped, faster than RATE_NONKEY_MIN all but keyframes
+constexpr double RATE_NONREF_MIN = 2.0;
+constexpr double RATE_NONKEY_MIN = 4.0;
 constexpr int AUDIO_CHANNELS_DEFAULT = 2;
+// a live read waits at least this many frame intervals, low-fps cameras are quiet for that long
+constexpr int READ_BUDGET_FRAMES = 4;
+constexpr int SLICE_MIN_HEIGHT = 64;
 
-constexpr int gResolution_[][2] = {
-        {256,  144},
-        {640,  360},    // 建议模式：16分屏
-        {800,  600},    //            9分屏
-        {1280, 720},    //            4分屏
-        {1920, 1080}    //            1分屏
-};
-static int checkVideoResolution(uint16_t width, uint16_t height) {
-    for (const auto &vr: gResolution_) {
-        if (vr[0] != width) continue;
-        return vr[1] == height ? 0 : -1;
+// requests smaller than this (e.g. a canvas that is not laid out yet) get the decoded size
+constexpr int OUTPUT_MIN_SIZE = 16;
+constexpr int OUTPUT_WIDTH_ALIGN = 8;
+constexpr int OUTPUT_HEIGHT_ALIGN = 2;
+
+static int read_budget_ms(const AVStream *st) {
+    if (!st || st->avg_frame_rate.num <= 0 || st->avg_frame_rate.den <= 0) {
+        return 0;
     }
-    return -1;
+    return (int)av_rescale(READ_BUDGET_FRAMES * 1000, st->avg_frame_rate.den, st->avg_frame_rate.num);
 }
 
 static int showBanner() {
@@ -41,12 +75,26 @@ static int showBanner() {
 }
 
 AVPixelFormat FfmpegWrapper::hw_pix_fmt_ = AV_PIX_FMT_NONE;
-FfmpegWrapper::FfmpegWrapper() : fmt_ctx_(nullptr), sws_init_(false), sws_ctx_(nullptr),
+FfmpegWrapper::FfmpegWrapper() : fmt_ctx_(nullptr),
                                  video_dec_ctx_(nullptr), audio_dec_ctx_(nullptr), hw_device_ctx_(nullptr),
-                                 sw_frame_(nullptr), frameYUV_(nullptr), stop_request_(0), video_dst_data_(nullptr),
+                                 sw_frame_(nullptr), crop_frame_(nullptr), last_frame_(av_frame_alloc()), snapshot_interval_(0),
+                                 next_snapshot_us_(0), repaint_pending_(false), last_motion_(0),
+                                 paused_(false), seek_request_ms_(-1), video_flush_(false), audio_flush_(false),
+                                 scrubbing_(false), scrub_request_ms_(-1), rate_(1.0), live_(false),
+                                 index_abort_(false), switch_ready_(false), switch_dec_ctx_(nullptr),
+                                 retired_fmt_ctx_(nullptr), serial_(0),
+                                 stop_request_(0),
                                  audio_dst_data_(nullptr), current_pts_audio_in_ms_(0), current_pts_video_in_ms_(0),
-                                 output_width_(-1), output_height_(-1), audio_stream_(nullptr), video_stream_(nullptr),
-                                 useGPU_(0), user_data_(nullptr), user_handle_(0), discard_frame_index_(0),
+                                 request_width_(0), request_height_(0), fit_mode_(FIT_Stretch),
+                                 roi_x_(0), roi_y_(0), roi_width_(0), roi_height_(0),
+                                 output_mode_(OUTPUT_Raw), output_format_(FORMAT_NV12), output_pix_fmt_(AV_PIX_FMT_NV12),
+                                 header_size_(HPP_HEADER_SIZE), bsf_ctx_(nullptr), bsf_pkt_(nullptr),
+                                 enc_ctx_(nullptr), enc_frame_(nullptr), enc_pkt_(nullptr), enc_buf_pool_(nullptr),
+                                 enc_buf_size_(0), enc_threads_(0), enc_last_pts_(AV_NOPTS_VALUE),
+                                 enc_bitrate_(ENCODE_BITRATE_DEFAULT), enc_gop_(ENCODE_GOP_DEFAULT),
+                                 enc_preset_(ENCODE_PRESET_DEFAULT),
+                                 video_stream_(nullptr), audio_stream_(nullptr),
+                                 useGPU_(0), stopped_(false), user_data_(nullptr), user_handle_(0), discard_frame_index_(0),
                                  discard_frame_enabled_(1), swr_init_(false), swr_ctx_(nullptr), audio_dev_(0),
                                  device_type_(AV_HWDEVICE_TYPE_NONE){
     av_log_set_callback([](void* avcl, int level, const char* fmt, va_list vl) {
@@ -91,9 +139,10 @@ FfmpegWrapper::FfmpegWrapper() : fmt_ctx_(nullptr), sws_init_(false), sws_ctx_(n
 }
 
 FfmpegWrapper::~FfmpegWrapper() {
-    if (!stop_request_) {
+    if (!stopped_) {
         stopPlay();
     }
+    av_frame_free(&last_frame_);
     SDL_Quit();
 }
 
@@ -105,39 +154,58 @@ int FfmpegWrapper::setCallback(void *user, uintptr_t handle, const FF_RAW_DATA_C
     return 0;
 }
 
+int FfmpegWrapper::setVideoFrameCallback(const FF_VIDEO_FRAME_CALLBACK &pfn) {
+    ff_video_frame_callback_ = pfn;
+    return 0;
+}
+
 int FfmpegWrapper::startPlay(const char *inputUrl, int width, int height,
                              int useGPU /*= 1*/, int useTCP /*= 1*/, int retryTimes/* = 3*/) {
     LOG_INFO << "[" << user_handle_ << "]startPlay url[" << inputUrl << "], GPU:" << useGPU;
-    this->output_width_ = width;
-    this->output_height_ = height;
+    this->request_width_ = width;
+    this->request_height_ = height;
     this->useGPU_ = useGPU;
     this->inputUrl_ = inputUrl;
 
     main_read_thread_handle_ = std::move(std::thread([this, useTCP, useGPU, retryTimes]() mutable {
         int ret = 0;
-        int video_stream_index;
-        int audio_stream_index;
+        int video_stream_index = -1;
+        int audio_stream_index = -1;
         AVPacket *pkt = nullptr;
+        std::unique_ptr<StandbyInput> standby;
         do {
-            if ((ret = open_input_url(inputUrl_.c_str(), useTCP, retryTimes)) != 0) {
+            // a preloaded url has been opened and probed already
+            if ((standby = StandbyPool::GetInstance().take(inputUrl_))) {
+                fmt_ctx_ = standby->fmt_ctx;
+                standby->fmt_ctx = nullptr;
+                mapped_input_ = std::move(standby->mapped);
+                // the protocols of the input call the interrupt it was opened with
+                standby->interrupt->retarget({ input_interrupt_cb, this });
+                interrupt_ = std::move(standby->interrupt);
+            } else if ((ret = OpenInputUrl(inputUrl_.c_str(), useTCP, retryTimes, { input_interrupt_cb, this },
+                                           &deadline_, &fmt_ctx_, &mapped_input_)) != 0) {
                 break;
             }
 
             /* retrieve stream information */
-            if ((ret = avformat_find_stream_info(fmt_ctx_, NULL)) < 0) {
+            deadline_.arm(IoDeadline::IO_Probe);
+            if (!standby && (ret = avformat_find_stream_info(fmt_ctx_, NULL)) < 0) {
                 LOG_ERROR << "Could not find stream information:" << av_err2str(ret);
                 break;
             }
 
-            if (open_codec_context(&video_stream_index, &video_dec_ctx_, fmt_ctx_, AVMEDIA_TYPE_VIDEO) >= 0) {
-                video_stream_ = fmt_ctx_->streams[video_stream_index];
-                if (0 != checkVideoResolution(output_width_, output_height_)) {
-                    output_width_ = video_dec_ctx_->width;
-                    output_height_ = video_dec_ctx_->height;
+            if (output_mode_ == OUTPUT_Packet) {
+                // the browser decodes, no video decoder is opened here
+                if (open_video_passthrough(&video_stream_index) >= 0) {
+                    video_stream_ = fmt_ctx_->streams[video_stream_index];
                 }
+            } else if (open_codec_context(&video_stream_index, &video_dec_ctx_, fmt_ctx_, AVMEDIA_TYPE_VIDEO) >= 0) {
+                video_stream_ = fmt_ctx_->streams[video_stream_index];
             }
 
-            if (open_codec_context(&audio_stream_index, &audio_dec_ctx_, fmt_ctx_, AVMEDIA_TYPE_AUDIO) >= 0) {
+            // snapshot only sessions are silent
+            if (snapshot_interval_ <= 0 &&
+                open_codec_context(&audio_stream_index, &audio_dec_ctx_, fmt_ctx_, AVMEDIA_TYPE_AUDIO) >= 0) {
                 audio_stream_ = fmt_ctx_->streams[audio_stream_index];
                 if (audio_dec_ctx_ && audio_open() < 0) {
                     LOG_WARN << "audio open failed. Maybe too many request.";
@@ -147,6 +215,8 @@ int FfmpegWrapper::startPlay(const char *inputUrl, int width, int height,
             /* dump input information to stderr */
             av_dump_format(fmt_ctx_, 0, inputUrl_.c_str(), 0);
 
+            open_keyframe_index();
+
             if (!audio_stream_ && !video_stream_) {
                 LOG_ERROR << "Could not find audio or video stream in the input, aborting";
                 ret = -1;
@@ -154,7 +224,8 @@ int FfmpegWrapper::startPlay(const char *inputUrl, int width, int height,
             }
 
             sw_frame_ = av_frame_alloc();
-            if (!sw_frame_) {
+            crop_frame_ = av_frame_alloc();
+            if (!sw_frame_ || !crop_frame_) {
                 LOG_ERROR << "Could not allocate frame";
                 ret = AVERROR(ENOMEM);
                 break;
@@ -173,35 +244,156 @@ int FfmpegWrapper::startPlay(const char *inputUrl, int width, int height,
             return;
         }
 
+        // live inputs share their latest GOP with later viewers of the same url
+        bool live = video_stream_ && (!fmt_ctx_->pb || !(fmt_ctx_->pb->seekable & AVIO_SEEKABLE_NORMAL));
+        live_ = live;
+        if (live) {
+            rate_ = 1.0;
+        }
+        int gop_subscriber = 0;
+        if (standby) {
+            queue_input_packets(&standby->packets, video_stream_index, audio_stream_index);
+            standby.reset();
+        } else if (live && output_mode_ != OUTPUT_Packet && snapshot_interval_ <= 0) {
+            gop_subscriber = prime_from_gop_cache();
+        }
+
         /* read frames from the input */
+        bool read_paused = false;
+        bool scrub_pending = false;     // waiting for the keyframe of a scrub position
+        // live inputs are read on while the decoders lag, so the socket never backs up
+        bool read_ahead = live && gConfig->inputQueueBytes > 0;
+        bool wait_keyframe = false;     // the queue was dropped without a keyframe to go on from
+        // playlists wait for their next segment inside the read, the demuxer times its reloads
+        bool playlist = !strcmp(fmt_ctx_->iformat->name, "hls");
+        int read_min_ms = read_budget_ms(video_stream_);
         while (!stop_request_) {
-            if (video_packet_queue_.size() >= MAX_PACKET_VIDEO || 
-                audio_packet_queue_.size() >= MAX_PACKET_AUDIO) {
+            // the new input of a switch takes over from here
+            if (switch_ready_) {
+                std::unique_ptr<PreparedInput> input = take_prepared_input();
+                if (input) {
+                    if (gop_subscriber) {
+                        GopCache::GetInstance().unsubscribe(inputUrl_, gop_subscriber);
+                        gop_subscriber = 0;
+                    }
+                    if (live) {
+                        GopCache::GetInstance().unpublish(inputUrl_, this);
+                    }
+                    install_prepared_input(input.get(), &video_stream_index, &audio_stream_index);
+                    live = !fmt_ctx_->pb || !(fmt_ctx_->pb->seekable & AVIO_SEEKABLE_NORMAL);
+                    live_ = live;
+                    if (live) {
+                        rate_ = 1.0;
+                    }
+                    read_ahead = live && gConfig->inputQueueBytes > 0;
+                    playlist = !strcmp(fmt_ctx_->iformat->name, "hls");
+                    read_min_ms = read_budget_ms(video_stream_);
+                    wait_keyframe = false;
+                    scrub_pending = false;
+                    read_paused = false;
+                }
+            }
+            // pause and seek requests are carried out on this thread, the one that reads
+            if (read_paused != paused_) {
+                read_paused = paused_;
+                deadline_.arm(IoDeadline::IO_Open);
+                read_paused ? av_read_pause(fmt_ctx_) : av_read_play(fmt_ctx_);
+            }
+            int64_t seek_ms = seek_request_ms_.exchange(-1);
+            if (seek_ms >= 0) {
+                seek_input(seek_ms);
+            }
+            int64_t scrub_ms = scrub_request_ms_.exchange(-1);
+            if (scrub_ms >= 0 && seek_input(scrub_ms) >= 0) {
+                scrub_pending = true;
+            }
+            if (!scrubbing_) {
+                scrub_pending = false;
+            } else if (!scrub_pending) {
+                std::this_thread::sleep_for(chrono::milliseconds(10));
+                continue;
+            }
+
+            if (!read_ahead && (video_packet_queue_.size() >= MAX_PACKET_VIDEO ||
+                audio_packet_queue_.size() >= MAX_PACKET_AUDIO)) {
                 std::this_thread::sleep_for(chrono::milliseconds(10));
                 continue;
             }
+            playlist ? deadline_.disarm() : deadline_.arm(IoDeadline::IO_Read, read_min_ms);
             ret = av_read_frame(fmt_ctx_, pkt);
             if (ret < 0 || !pkt) {
+                // the read was interrupted for a switch, this input is retired anyway
+                if (switch_ready_) {
+                    continue;
+                }
+                // a dead input ends the session instead of being polled on, a paused one may be silent
+                if (deadline_.expired() && !read_paused) {
+                    ret = AVERROR(ETIMEDOUT);
+                    break;
+                }
                 if (fmt_ctx_->pb && fmt_ctx_->pb->error)
                     break;
 
                 std::this_thread::sleep_for(chrono::milliseconds(10));
                 continue;
             }
-            preTime_ = time(nullptr);
+
+            // only the first video keyframe after a scrub position is decoded
+            if (scrub_pending) {
+                if (pkt->stream_index == video_stream_index && (pkt->flags & AV_PKT_FLAG_KEY)) {
+                    video_packet_queue_.put(pkt);
+                    scrub_pending = false;
+                }
+                av_packet_unref(pkt);
+                continue;
+            }
 
             // check if the packet belongs to a stream we are interested in, otherwise
             // skip it
-            if (pkt->stream_index == video_stream_index)
+            if (pkt->stream_index == video_stream_index) {
+                if (live) {
+                    GopCache::GetInstance().publish(inputUrl_, this, video_stream_->codecpar,
+                                                    video_stream_->time_base, pkt);
+                }
+                {
+                    std::lock_guard<std::mutex> lk(recorder_mutex_);
+                    if (recorder_) {
+                        recorder_->write(video_stream_->codecpar, video_stream_->time_base, pkt);
+                    }
+                }
+                // primed decoders follow the cached stream up to a keyframe of our own
+                if (gop_subscriber && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+                    av_packet_unref(pkt);
+                    continue;
+                }
+                if (gop_subscriber) {
+                    GopCache::GetInstance().unsubscribe(inputUrl_, gop_subscriber);
+                    gop_subscriber = 0;
+                }
+                if (wait_keyframe && !(pkt->flags & AV_PKT_FLAG_KEY)) {
+                    av_packet_unref(pkt);
+                    continue;
+                }
+                wait_keyframe = false;
                 video_packet_queue_.put(pkt);
-            else if (pkt->stream_index == audio_stream_index) {
+            } else if (pkt->stream_index == audio_stream_index) {
                 audio_packet_queue_.put(pkt);
             }
             av_packet_unref(pkt);
+            if (read_ahead) {
+                trim_live_queues(&wait_keyframe);
+            }
+        }
+
+        if (gop_subscriber) {
+            GopCache::GetInstance().unsubscribe(inputUrl_, gop_subscriber);
+        }
+        if (live) {
+            GopCache::GetInstance().unpublish(inputUrl_, this);
         }
 
         /* flush the decoders */
-        if (video_dec_ctx_)
+        if (video_dec_ctx_ || bsf_ctx_)
             video_packet_queue_.put(pkt);
         if (audio_dec_ctx_)
             audio_packet_queue_.put(pkt);
@@ -217,11 +409,24 @@ int FfmpegWrapper::startPlay(const char *inputUrl, int width, int height,
     return 0;
 }
 
-int FfmpegWrapper::stopPlay() {
-    LOG_INFO << "[" << user_handle_ << "]stopPlay";
-    stop_request_ = 1;
+void FfmpegWrapper::requestStop() {
+    {
+        std::lock_guard<std::mutex> lk(pause_mutex_);
+        stop_request_ = 1;
+    }
+    pause_cond_.notify_all();
     video_packet_queue_.stop();
     audio_packet_queue_.stop();
+    index_abort_ = true;
+}
+
+int FfmpegWrapper::stopPlay() {
+    LOG_INFO << "[" << user_handle_ << "]stopPlay";
+    requestStop();
+    {
+        std::unique_lock<std::mutex> lk(repaint_mutex_);
+        repaint_cond_.wait(lk, [this]() { return !repaint_pending_; });
+    }
     if (audio_decode_thread_handle_.joinable()) {
         audio_decode_thread_handle_.join();
     }
@@ -231,35 +436,89 @@ int FfmpegWrapper::stopPlay() {
     if (main_read_thread_handle_.joinable()) {
         main_read_thread_handle_.join();
     }
+    cancel_switch();
+    avcodec_free_context(&switch_dec_ctx_);
+    avformat_close_input(&retired_fmt_ctx_);
+    retired_mapped_.reset();
+    retired_interrupt_.reset();
+    if (index_thread_.joinable()) {
+        index_thread_.join();
+    }
+    {
+        std::lock_guard<std::mutex> lk(index_mutex_);
+        index_.reset();
+    }
+
+    stopRecord();
 
-    sws_freeContext(sws_ctx_);
     swr_free(&swr_ctx_);
 
     avcodec_free_context(&video_dec_ctx_);
     avcodec_free_context(&audio_dec_ctx_);
     avformat_close_input(&fmt_ctx_);
+    mapped_input_.reset();
+    interrupt_.reset();
     av_buffer_unref(&hw_device_ctx_);
 
+    av_bsf_free(&bsf_ctx_);
+    av_packet_free(&bsf_pkt_);
+    close_encoder();
+    av_frame_free(&enc_frame_);
+    av_packet_free(&enc_pkt_);
+
     av_frame_free(&sw_frame_);
-    av_frame_free(&frameYUV_);
-    av_freep(&video_dst_data_);
+    av_frame_free(&crop_frame_);
+    {
+        std::lock_guard<std::mutex> lk(last_frame_mutex_);
+        av_frame_unref(last_frame_);
+    }
     av_freep(&audio_dst_data_);
 
     SDL_CloseAudioDevice(audio_dev_);
+    audio_dev_ = 0;
+    stopped_ = true;
     return 0;
 }
 
 int FfmpegWrapper::changeVideoResolution(int width, int height) {
-    if (width == 0 || height == 0) {
-        output_width_ = video_dec_ctx_->width;
-        output_height_ = video_dec_ctx_->height;
-    } else {
-        output_width_ = width;
-        output_height_ = height;
+    {
+        std::lock_guard<std::mutex> lk(output_mutex_);
+        if (request_width_ == width && request_height_ == height) {
+            return 0;
+        }
+        request_width_ = width;
+        request_height_ = height;
     }
+    request_repaint();
+    return 0;
+}
 
-    sws_init_ = false;
+int FfmpegWrapper::setFitMode(int fitMode) {
+    if (fitMode < FIT_Stretch || fitMode > FIT_Cover) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lk(output_mutex_);
+    fit_mode_ = fitMode;
+    return 0;
+}
 
+int FfmpegWrapper::setCropRegion(double x, double y, double width, double height) {
+    if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(width) || !std::isfinite(height)) {
+        return -1;
+    }
+    if (width == 0 || height == 0) {
+        x = y = width = height = 0;
+    } else if (x < 0 || y < 0 || width < 0 || height < 0 || x + width > 1.0 || y + height > 1.0) {
+        return -1;
+    }
+    {
+        std::lock_guard<std::mutex> lk(output_mutex_);
+        roi_x_ = x;
+        roi_y_ = y;
+        roi_width_ = width;
+        roi_height_ = height;
+    }
+    request_repaint();
     return 0;
 }
 
@@ -268,6 +527,575 @@ int FfmpegWrapper::openDiscardFrames(int enabled) {
     return 0;
 }
 
+int FfmpegWrapper::setOutputMode(int mode) {
+    if (mode < OUTPUT_Raw || mode > OUTPUT_Transcode) {
+        return InvalidParameter;
+    }
+    if (mode == OUTPUT_Transcode && !FindH264Encoder()) {
+        return FFEncoderNotFound;
+    }
+    output_mode_ = mode;
+    return 0;
+}
+
+int FfmpegWrapper::setOutputFormat(int format) {
+    if (format < FORMAT_NV12 || format > FORMAT_RGBA) {
+        return InvalidParameter;
+    }
+    output_format_ = format;
+    output_pix_fmt_ = OUTPUT_PIX_FMTS[format];
+    header_size_ = HPP_HEADER_V2_SIZE;
+    return 0;
+}
+
+int FfmpegWrapper::setCompression(int enabled) {
+    if (enabled) {
+        compressor_.reset(new FrameCompressor(user_handle_));
+        header_size_ = HPP_HEADER_V2_SIZE;
+    } else {
+        compressor_.reset();
+    }
+    return 0;
+}
+
+int FfmpegWrapper::setDelta(int blockSize, int threshold, int interval) {
+    if (blockSize == 0) {
+        delta_.reset();
+        return 0;
+    }
+    if ((blockSize != 16 && blockSize != 64) || threshold < 0 || interval < 0) {
+        return InvalidParameter;
+    }
+    delta_.reset(new DeltaEncoder(blockSize, threshold ? threshold : DELTA_THRESHOLD_DEFAULT,
+                                  interval ? interval : DELTA_INTERVAL_DEFAULT));
+    header_size_ = HPP_HEADER_V2_SIZE;
+    return 0;
+}
+
+int FfmpegWrapper::setMotionAdaptive(int enabled, int idleFps, int threshold) {
+    if (!enabled) {
+        motion_.reset();
+        return 0;
+    }
+    if (idleFps < 0 || threshold < 0 || threshold > 100) {
+        return InvalidParameter;
+    }
+    motion_.reset(new MotionDetector(idleFps, threshold ? threshold : MOTION_THRESHOLD_DEFAULT));
+    header_size_ = HPP_HEADER_V2_SIZE;
+    return 0;
+}
+
+int FfmpegWrapper::setSnapshotInterval(int seconds) {
+    if (seconds < 0) {
+        return InvalidParameter;
+    }
+    snapshot_interval_ = seconds;
+    return 0;
+}
+
+int FfmpegWrapper::snapshot(int format, int width, int height, int quality, std::string *image, std::string *mime) {
+    AVFramePtr frame(av_frame_alloc(), [](AVFrame* f) {av_frame_free(&f); });
+    if (!frame) {
+        return AVERROR(ENOMEM);
+    }
+    {
+        std::lock_guard<std::mutex> lk(last_frame_mutex_);
+        if (!last_frame_->buf[0]) {
+            return FFNoFrameDecoded;
+        }
+        av_frame_ref(frame.get(), last_frame_);
+    }
+
+    // hardware frames are only downloaded when a snapshot is taken
+    if (frame->hw_frames_ctx) {
+        AVFramePtr sw(av_frame_alloc(), [](AVFrame* f) {av_frame_free(&f); });
+        int ret = sw ? av_hwframe_transfer_data(sw.get(), frame.get(), 0) : AVERROR(ENOMEM);
+        if (ret < 0) {
+            LOG_ERROR << "Error transferring the snapshot to system memory(" << av_err2str(ret);
+            return ret;
+        }
+        frame = sw;
+    }
+
+    if (width < 0 || height < 0) {
+        return InvalidParameter;
+    }
+    if (width == 0 && height == 0) {
+        width = frame->width;
+        height = frame->height;
+    } else if (width == 0) {
+        width = (int)av_rescale(height, frame->width, frame->height);
+    } else if (height == 0) {
+        height = (int)av_rescale(width, frame->height, frame->width);
+    }
+    width = av_clip(width, 1, frame->width);
+    height = av_clip(height, 1, frame->height);
+    return ImageEncoder::Encode(frame.get(), width, height, format, quality, image, mime);
+}
+
+int FfmpegWrapper::startRecord(const std::string &dir, int segmentSeconds, int maxSegments) {
+    if (dir.empty() || segmentSeconds < 0 || maxSegments < 0) {
+        return InvalidParameter;
+    }
+    std::lock_guard<std::mutex> lk(recorder_mutex_);
+    if (recorder_) {
+        return InvalidParameter;
+    }
+    recorder_.reset(new Recorder(user_handle_, dir, segmentSeconds, maxSegments));
+    return 0;
+}
+
+int FfmpegWrapper::stopRecord() {
+    std::unique_ptr<Recorder> recorder;
+    {
+        std::lock_guard<std::mutex> lk(recorder_mutex_);
+        recorder = std::move(recorder_);
+    }
+    // the read thread no longer sees it, the last segment is finished outside the lock
+    if (recorder) {
+        recorder->stop();
+    }
+    return 0;
+}
+
+int FfmpegWrapper::pause(int paused) {
+    {
+        std::lock_guard<std::mutex> lk(pause_mutex_);
+        paused_ = paused != 0;
+    }
+    pause_cond_.notify_all();
+    if (audio_dev_ >= 2) {
+        SDL_PauseAudioDevice(audio_dev_, paused ? 1 : 0);
+    }
+    return 0;
+}
+
+int FfmpegWrapper::seek(int64_t positionMs) {
+    if (positionMs < 0) {
+        return InvalidParameter;
+    }
+    scrubbing_ = false;
+    scrub_request_ms_ = -1;
+    seek_request_ms_ = positionMs;
+    return 0;
+}
+
+int FfmpegWrapper::scrub(int64_t positionMs, int done) {
+    if (positionMs < 0) {
+        return InvalidParameter;
+    }
+    if (done) {
+        return seek(positionMs);
+    }
+    {
+        std::lock_guard<std::mutex> lk(pause_mutex_);
+        scrubbing_ = true;
+        scrub_request_ms_ = positionMs;
+    }
+    // a paused session shows the scrub frames too
+    pause_cond_.notify_all();
+    return 0;
+}
+
+FfmpegWrapper::PreparedInput::PreparedInput(FfmpegWrapper *wrapper, const std::string &inputUrl) :
+        owner(wrapper), cancel(false), source(new StandbyInput()),
+        audio_index(-1), video_dec_ctx(nullptr) {
+    source->url = inputUrl;
+}
+
+FfmpegWrapper::PreparedInput::~PreparedInput() {
+    source.reset();
+    avcodec_free_context(&video_dec_ctx);
+}
+
+int FfmpegWrapper::switchInput(const char *inputUrl, int useTCP, const FF_SWITCH_CALLBACK &pfn) {
+    if (output_mode_ == OUTPUT_Packet || !video_stream_ || !video_dec_ctx_ || stop_request_) {
+        return NotSupport;
+    }
+    LOG_INFO << "[" << user_handle_ << "]switch to url[" << inputUrl << "]";
+
+    // a switch that is still being prepared is given up for the newer one
+    cancel_switch();
+    PreparedInput *input = new PreparedInput(this, inputUrl);
+    input->installed = pfn;
+    {
+        std::lock_guard<std::mutex> lk(switch_mutex_);
+        switch_input_.reset(input);
+    }
+    switch_thread_ = std::thread(&FfmpegWrapper::prepare_input, this, input, useTCP);
+    return 0;
+}
+
+void FfmpegWrapper::cancel_switch() {
+    {
+        std::lock_guard<std::mutex> lk(switch_mutex_);
+        if (switch_input_) {
+            switch_input_->cancel = true;
+        }
+    }
+    if (switch_thread_.joinable()) {
+        switch_thread_.join();
+    }
+    std::unique_ptr<PreparedInput> input;
+    {
+        std::lock_guard<std::mutex> lk(switch_mutex_);
+        switch_ready_ = false;
+        input = std::move(switch_input_);
+    }
+}
+
+// switch thread. the current input plays on meanwhile, its streams do not change before this
+// input is installed.
+void FfmpegWrapper::prepare_input(PreparedInput *input, int useTCP) {
+    int ret = 0;
+    // a preloaded url has been opened and probed already
+    std::unique_ptr<StandbyInput> standby = StandbyPool::GetInstance().take(input->source->url);
+    bool preloaded = !!standby;
+    if (preloaded) {
+        input->source = std::move(standby);
+    }
+    input->source->interrupt->retarget({ prepared_interrupt_cb, input });
+    if (!preloaded) {
+        ret = OpenInputUrl(input->source->url.c_str(), useTCP, 1, input->source->interrupt->callback(),
+                           &input->deadline, &input->source->fmt_ctx, &input->source->mapped);
+    }
+    StandbyInput *source = input->source.get();
+    do {
+        if (ret != 0) {
+            break;
+        }
+        input->deadline.arm(IoDeadline::IO_Probe);
+        if (!preloaded && (ret = avformat_find_stream_info(source->fmt_ctx, NULL)) < 0) {
+            break;
+        }
+        if (!preloaded &&
+            (ret = source->video_index = av_find_best_stream(source->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0)) < 0) {
+            break;
+        }
+
+        const AVCodecParameters *par = source->fmt_ctx->streams[source->video_index]->codecpar;
+        const AVCodecParameters *current = video_stream_->codecpar;
+        // parameter sets may only be in the extradata (avcC, rtsp sprop), they have to match too
+        bool reuse = par->codec_id == current->codec_id && par->width == current->width &&
+                     par->height == current->height && par->format == current->format &&
+                     par->extradata_size == current->extradata_size &&
+                     (par->extradata_size == 0 || memcmp(par->extradata, current->extradata, par->extradata_size) == 0);
+        int stream_index = -1;
+        if (!reuse && (ret = open_codec_context(&stream_index, &input->video_dec_ctx, source->fmt_ctx,
+                                                AVMEDIA_TYPE_VIDEO)) < 0) {
+            break;
+        }
+
+        // the audio device stays as it is, audio of another format is not played
+        if (audio_dec_ctx_) {
+            int audio_index = av_find_best_stream(source->fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+            const AVCodecParameters *audio = audio_index >= 0 ? source->fmt_ctx->streams[audio_index]->codecpar : nullptr;
+            if (audio && audio->codec_id == audio_dec_ctx_->codec_id &&
+                audio->sample_rate == audio_dec_ctx_->sample_rate && audio->channels == audio_dec_ctx_->channels) {
+                input->audio_index = audio_index;
+            }
+        }
+
+        // preloaded inputs come with their packets from a keyframe on
+        if (source->packets.empty()) {
+            AVPacket *keyframe = av_packet_alloc();
+            if (!keyframe) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            source->packets.push_back(keyframe);
+            while (true) {
+                input->deadline.arm(IoDeadline::IO_Read);
+                if ((ret = av_read_frame(source->fmt_ctx, keyframe)) < 0 ||
+                    (keyframe->stream_index == source->video_index && (keyframe->flags & AV_PKT_FLAG_KEY))) {
+                    break;
+                }
+                av_packet_unref(keyframe);
+            }
+        }
+        LOG_INFO << "[" << user_handle_ << "]switch input ready, decoder " << (reuse ? "kept" : "opened")
+                 << (preloaded ? ", preloaded" : "");
+    } while (0);
+
+    if (ret < 0 || ret == FFOpenUrlFailed) {
+        if (!input->cancel && !stop_request_ && ff_exception_callback_ && user_data_) {
+            LOG_ERROR << "[" << user_handle_ << "]Could not switch to " << source->url << ", playing on";
+            ff_exception_callback_(user_data_, user_handle_, FFOpenUrlFailed, (const uint8_t *)"switch url failed.");
+        }
+        return;
+    }
+    switch_ready_ = true;
+}
+
+std::unique_ptr<FfmpegWrapper::PreparedInput> FfmpegWrapper::take_prepared_input() {
+    std::lock_guard<std::mutex> lk(switch_mutex_);
+    switch_ready_ = false;
+    return std::move(switch_input_);
+}
+
+// read thread. the previous input is kept open until the next switch, the decode threads may
+// still be on its last packets.
+void FfmpegWrapper::install_prepared_input(PreparedInput *input, int *video_stream_index, int *audio_stream_index) {
+    StandbyInput *source = input->source.get();
+    LOG_INFO << "[" << user_handle_ << "]switched to url[" << source->url << "]";
+    stopRecord();
+
+    avformat_close_input(&retired_fmt_ctx_);
+    retired_mapped_ = std::move(mapped_input_);
+    retired_interrupt_ = std::move(interrupt_);
+    retired_fmt_ctx_ = fmt_ctx_;
+    fmt_ctx_ = source->fmt_ctx;
+    source->fmt_ctx = nullptr;
+    mapped_input_ = std::move(source->mapped);
+    // the protocols of the input call the interrupt it was opened with
+    source->interrupt->retarget({ input_interrupt_cb, this });
+    interrupt_ = std::move(source->interrupt);
+    inputUrl_ = source->url;
+    if (input->installed) {
+        input->installed(inputUrl_);
+    }
+
+    *video_stream_index = source->video_index;
+    *audio_stream_index = input->audio_index;
+    video_stream_ = fmt_ctx_->streams[source->video_index];
+    audio_stream_ = input->audio_index >= 0 ? fmt_ctx_->streams[input->audio_index] : nullptr;
+    {
+        std::lock_guard<std::mutex> lk(switch_mutex_);
+        avcodec_free_context(&switch_dec_ctx_);
+        switch_dec_ctx_ = input->video_dec_ctx;
+        input->video_dec_ctx = nullptr;
+    }
+
+    serial_++;
+    video_packet_queue_.flush();
+    audio_packet_queue_.flush();
+    video_packet_queue_.setSerial(serial_);
+    audio_packet_queue_.setSerial(serial_);
+    queue_input_packets(&source->packets, *video_stream_index, *audio_stream_index);
+
+    // the index of the previous file does not apply any more
+    if (index_thread_.joinable()) {
+        index_abort_ = true;
+        index_thread_.join();
+        index_abort_ = stop_request_ != 0;
+    }
+    {
+        std::lock_guard<std::mutex> lk(index_mutex_);
+        index_.reset();
+    }
+    open_keyframe_index();
+}
+
+// Packets read ahead of the session by a preloaded or switched input, from a keyframe on. Those
+// of a live input are behind by now: its video is decoded without output up to the latest
+// picture and its audio is left out.
+void FfmpegWrapper::queue_input_packets(std::vector<AVPacket *> *packets, int video_stream_index, int audio_stream_index) {
+    bool live = !fmt_ctx_->pb || !(fmt_ctx_->pb->seekable & AVIO_SEEKABLE_NORMAL);
+    const AVPacket *last_video = nullptr;
+    for (const AVPacket *pkt : *packets) {
+        if (pkt->stream_index == video_stream_index) {
+            last_video = pkt;
+        }
+    }
+    for (AVPacket *pkt : *packets) {
+        if (pkt->stream_index == video_stream_index) {
+            if (live && pkt != last_video && output_mode_ != OUTPUT_Packet) {
+                pkt->flags |= AV_PKT_FLAG_DISCARD;
+            }
+            video_packet_queue_.put(pkt);
+        } else if (pkt->stream_index == audio_stream_index && !live) {
+            audio_packet_queue_.put(pkt);
+        }
+        av_packet_free(&pkt);
+    }
+    packets->clear();
+}
+
+// video decode thread, at the first packet of a new input
+void FfmpegWrapper::change_video_decoder() {
+    AVCodecContext *dec_ctx = nullptr;
+    {
+        std::lock_guard<std::mutex> lk(switch_mutex_);
+        std::swap(dec_ctx, switch_dec_ctx_);
+    }
+    if (dec_ctx) {
+        avcodec_free_context(&video_dec_ctx_);
+        video_dec_ctx_ = dec_ctx;
+    } else if (video_dec_ctx_) {
+        avcodec_flush_buffers(video_dec_ctx_);
+    }
+}
+
+int FfmpegWrapper::setRate(double rate) {
+    if (rate < RATE_MIN || rate > RATE_MAX) {
+        return InvalidParameter;
+    }
+    if (live_) {
+        return NotSupport;
+    }
+    rate_ = rate;
+    return 0;
+}
+
+// decode thread. the decoder leaves out what is not shown at the rate instead of decoding it
+// for nothing, keyframes only is done by not sending the other packets at all.
+void FfmpegWrapper::apply_rate(double rate) {
+    LOG_INFO << "[" << user_handle_ << "]playback rate " << rate;
+    if (video_dec_ctx_) {
+        video_dec_ctx_->skip_frame = rate > RATE_NONREF_MIN ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    }
+}
+
+// Local files that can be seeked get a keyframe index: the sidecar if it is current, otherwise
+// it is built in the background and seeks go through the demuxer until then.
+void FfmpegWrapper::open_keyframe_index() {
+    std::string path;
+    if (!video_stream_ || !fmt_ctx_->pb || !(fmt_ctx_->pb->seekable & AVIO_SEEKABLE_NORMAL) ||
+        !KeyframeIndex::LocalPath(inputUrl_, &path)) {
+        return;
+    }
+    // playlists change while recording, their segments are indexed by the recorder
+    if (!strcmp(fmt_ctx_->iformat->name, "hls")) {
+        return;
+    }
+
+    auto index = std::make_shared<KeyframeIndex>();
+    if (index->load(path)) {
+        LOG_INFO << "[" << user_handle_ << "]keyframe index with " << index->size() << " entries";
+        std::lock_guard<std::mutex> lk(index_mutex_);
+        index_ = index;
+        return;
+    }
+    index_thread_ = std::thread([this, path]() {
+        int64_t start = av_gettime_relative();
+        AVRational time_base;
+        std::vector<KeyframeIndex::Entry> entries;
+        int ret = KeyframeIndex::Build(path, index_abort_, &time_base, &entries);
+        if (ret >= 0) {
+            ret = KeyframeIndex::Save(path, time_base, entries);
+        }
+        auto index = std::make_shared<KeyframeIndex>();
+        if (ret < 0 || !index->load(path)) {
+            if (!index_abort_) {
+                LOG_WARN << "[" << user_handle_ << "]Could not build keyframe index of " << path << ": "
+                         << av_err2str(ret < 0 ? ret : AVERROR_INVALIDDATA);
+            }
+            return;
+        }
+        LOG_INFO << "[" << user_handle_ << "]built keyframe index with " << index->size() << " entries in "
+                 << (av_gettime_relative() - start) / 1000 << "ms";
+        std::lock_guard<std::mutex> lk(index_mutex_);
+        index_ = index;
+    });
+}
+
+// The keyframe at or before the position, by its byte offset where the demuxer allows byte
+// seeks (mpegts), otherwise by its exact timestamp (mp4), so the demuxer does not search.
+int FfmpegWrapper::seek_by_index(int64_t position_ms) {
+    std::shared_ptr<KeyframeIndex> index;
+    {
+        std::lock_guard<std::mutex> lk(index_mutex_);
+        index = index_;
+    }
+    if (!index || !video_stream_) {
+        return AVERROR(ENOSYS);
+    }
+
+    AVRational time_base = index->timeBase();
+    int64_t target = av_rescale_q(position_ms, { 1, 1000 }, time_base);
+    if (video_stream_->start_time != AV_NOPTS_VALUE) {
+        target += av_rescale_q(video_stream_->start_time, video_stream_->time_base, time_base);
+    }
+    KeyframeIndex::Entry entry;
+    if (!index->find(target, &entry)) {
+        return AVERROR(ENOSYS);
+    }
+    if (entry.pos >= 0 && !(fmt_ctx_->iformat->flags & AVFMT_NO_BYTE_SEEK) &&
+        avformat_seek_file(fmt_ctx_, -1, entry.pos, entry.pos, entry.pos, AVSEEK_FLAG_BYTE) >= 0) {
+        return 0;
+    }
+    int64_t ts = av_rescale_q(entry.pts, time_base, video_stream_->time_base);
+    return avformat_seek_file(fmt_ctx_, video_stream_->index, ts, ts, ts, 0);
+}
+
+// read thread. queued packets are dropped, the decode threads flush their decoders before the
+// next packet, which is from the new position.
+int FfmpegWrapper::seek_input(int64_t position_ms) {
+    int64_t ts = av_rescale(position_ms, AV_TIME_BASE, 1000);
+    if (fmt_ctx_->start_time != AV_NOPTS_VALUE) {
+        ts += fmt_ctx_->start_time;
+    }
+    // a seek of a network input is a request of its own
+    deadline_.arm(IoDeadline::IO_Open);
+    int ret = seek_by_index(position_ms);
+    if (ret < 0) {
+        ret = avformat_seek_file(fmt_ctx_, -1, INT64_MIN, ts, ts, 0);
+    }
+    if (ret < 0) {
+        LOG_WARN << "[" << user_handle_ << "]Could not seek to " << position_ms << "ms: " << av_err2str(ret);
+        return ret;
+    }
+    video_packet_queue_.flush();
+    audio_packet_queue_.flush();
+    video_flush_ = true;
+    audio_flush_ = true;
+    return 0;
+}
+
+// The decoders are too far behind a live input: the oldest GOPs are dropped, decoding goes on
+// from the newest keyframe queued (or the next one read).
+void FfmpegWrapper::trim_live_queues(bool *wait_keyframe) {
+    bool found = false;
+    if (video_packet_queue_.bytes() > gConfig->inputQueueBytes) {
+        int dropped = video_packet_queue_.dropToKeyframe(&found);
+        *wait_keyframe = !found;
+        LOG_WARN << "[" << user_handle_ << "]decoding is behind, " << dropped << " video packets dropped";
+    }
+    if (audio_packet_queue_.size() > MAX_PACKET_AUDIO_LIVE) {
+        audio_packet_queue_.dropToKeyframe(&found);
+    }
+}
+
+bool FfmpegWrapper::wait_while_paused() {
+    if (!paused_ || scrubbing_) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lk(pause_mutex_);
+    pause_cond_.wait(lk, [this]() { return !paused_ || scrubbing_ || stop_request_; });
+    return true;
+}
+
+int FfmpegWrapper::requestFullFrame() {
+    if (delta_) {
+        delta_->requestFull();
+    }
+    return 0;
+}
+
+int FfmpegWrapper::setTranscodeOptions(int bitrateKbps, int gop, const std::string &preset) {
+    if (bitrateKbps < 0 || gop < 0) {
+        return InvalidParameter;
+    }
+    if (bitrateKbps > 0) {
+        enc_bitrate_ = bitrateKbps;
+    }
+    if (gop > 0) {
+        enc_gop_ = gop;
+    }
+    if (!preset.empty()) {
+        enc_preset_ = preset;
+    }
+    return 0;
+}
+
+const AVCodec *FfmpegWrapper::FindH264Encoder() {
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
+    if (!codec) {
+        codec = avcodec_find_encoder_by_name("libopenh264");
+    }
+    return codec;
+}
+
 int FfmpegWrapper::retrieve_frame(AVFrame* in, AVFrame** out) {
     int ret = 0;
     if (in->format != hw_pix_fmt_) {
@@ -284,88 +1112,312 @@ int FfmpegWrapper::retrieve_frame(AVFrame* in, AVFrame** out) {
     return ret;
 }
 
-int FfmpegWrapper::scale_frame(AVFrame* in, AVFrame** out) {
+// Output size and source region for a decoded frame. The requested box is never exceeded and the
+// picture is never scaled up, so what is converted and sent matches what the canvas can show.
+// The region of interest is applied first, fit modes then work inside it.
+void FfmpegWrapper::compute_output_geometry(const AVFrame* in, Rect* crop, int* width, int* height) {
+    int request_width, request_height, fit_mode;
+    double roi_x, roi_y, roi_width, roi_height;
+    {
+        std::lock_guard<std::mutex> lk(output_mutex_);
+        request_width = request_width_;
+        request_height = request_height_;
+        fit_mode = fit_mode_;
+        roi_x = roi_x_;
+        roi_y = roi_y_;
+        roi_width = roi_width_;
+        roi_height = roi_height_;
+    }
+
+    *crop = { 0, 0, in->width, in->height };
+    if (roi_width > 0 && roi_height > 0) {
+        // even offsets and sizes keep the chroma planes of 4:2:0 sources aligned
+        int w = FFMAX((int)(roi_width * in->width) & ~1, OUTPUT_MIN_SIZE);
+        int h = FFMAX((int)(roi_height * in->height) & ~1, OUTPUT_MIN_SIZE);
+        crop->width = FFMIN(w, in->width & ~1);
+        crop->height = FFMIN(h, in->height & ~1);
+        crop->x = FFMIN((int)(roi_x * in->width) & ~1, (in->width - crop->width) & ~1);
+        crop->y = FFMIN((int)(roi_y * in->height) & ~1, (in->height - crop->height) & ~1);
+    }
+
+    if (request_width < OUTPUT_MIN_SIZE || request_height < OUTPUT_MIN_SIZE) {
+        *width = crop->width;
+        *height = crop->height;
+        return;
+    }
+
+    double src_width = crop->width;
+    double src_height = crop->height;
+    int w, h;
+    switch (fit_mode) {
+    case FIT_Contain: {
+        double scale = FFMIN3(request_width / src_width, request_height / src_height, 1.0);
+        w = (int)(src_width * scale);
+        h = (int)(src_height * scale);
+        break;
+    }
+    case FIT_Cover: {
+        // keep the centre of the picture with the aspect ratio of the box
+        double scale = FFMAX(request_width / src_width, request_height / src_height);
+        int crop_width = FFMIN(crop->width, (int)(request_width / scale)) & ~1;
+        int crop_height = FFMIN(crop->height, (int)(request_height / scale)) & ~1;
+        crop->x += ((crop->width - crop_width) / 2) & ~1;
+        crop->y += ((crop->height - crop_height) / 2) & ~1;
+        crop->width = crop_width;
+        crop->height = crop_height;
+        scale = FFMIN(scale, 1.0);
+        w = (int)(crop_width * scale);
+        h = (int)(crop_height * scale);
+        break;
+    }
+    case FIT_Stretch:
+    default:
+        w = FFMIN(request_width, crop->width);
+        h = FFMIN(request_height, crop->height);
+        break;
+    }
+
+    *width = FFMAX(w & ~(OUTPUT_WIDTH_ALIGN - 1), OUTPUT_WIDTH_ALIGN);
+    *height = FFMAX(h & ~(OUTPUT_HEIGHT_ALIGN - 1), OUTPUT_HEIGHT_ALIGN);
+}
+
+// Crops by moving the plane pointers of a new reference, the pixels are not copied.
+int FfmpegWrapper::crop_frame(AVFrame* in, const Rect& crop, AVFrame** out) {
     int ret = 0;
-    if (in->width == output_width_ && in->height == output_height_ &&
-        in->format == TARGET_PIX_FMT) {
+    if (crop.x == 0 && crop.y == 0 && crop.width == in->width && crop.height == in->height) {
         *out = in;
-        return ret;
+        return 0;
     }
 
-    if (!sws_init_) {
-        if (sws_ctx_) {
-            sws_freeContext(sws_ctx_);
-            sws_ctx_ = nullptr;
-        }
-        av_frame_free(&frameYUV_);
-        av_freep(&video_dst_data_);
+    av_frame_unref(crop_frame_);
+    if ((ret = av_frame_ref(crop_frame_, in)) < 0) {
+        return ret;
     }
-    if (!sws_ctx_) {
-        // 如果明确是要缩小并显示，建议使用SWS_POINT算法
-        // 在不明确是放大还是缩小时，直接使用 SWS_FAST_BILINEAR 算法即可。
-        sws_ctx_ = sws_getContext(in->width, in->height,
-            (AVPixelFormat)in->format,
-            output_width_, output_height_,
-            TARGET_PIX_FMT,
-            SWS_POINT, NULL, NULL, NULL);
+    crop_frame_->crop_left = crop.x;
+    crop_frame_->crop_top = crop.y;
+    crop_frame_->crop_right = in->width - crop.x - crop.width;
+    crop_frame_->crop_bottom = in->height - crop.y - crop.height;
+    if ((ret = av_frame_apply_cropping(crop_frame_, AV_FRAME_CROP_UNALIGNED)) < 0) {
+        LOG_ERROR << "Could not crop frame: " << av_err2str(ret);
+        return ret;
     }
+    *out = crop_frame_;
+    return 0;
+}
 
-    if (!frameYUV_) {
-        frameYUV_ = av_frame_alloc();
-        if (!frameYUV_) {
-            LOG_ERROR << "Could not allocate frame";
-            ret = AVERROR(ENOMEM);
-            return ret;
+// Scaled planes are written straight into the packed buffer behind the frame header
+// (linesize == width), so no intermediate frame and no extra copy are needed.
+int FfmpegWrapper::scale_frame(AVFrame* in, int width, int height, enum AVPixelFormat format, uint8_t* dst, int size) {
+    int ret = 0;
+    uint8_t* dst_data[4] = { nullptr };
+    int dst_linesize[4] = { 0 };
+    if ((ret = av_image_fill_arrays(dst_data, dst_linesize, dst, format, width, height, 1)) < 0) {
+        LOG_ERROR << "Can not fill image arrays: " << av_err2str(ret);
+        return ret;
+    }
+
+    if (in->width == width && in->height == height) {
+        if (in->format == format) {
+            av_image_copy(dst_data, dst_linesize, (const uint8_t**)in->data, in->linesize,
+                format, width, height);
+            return 0;
         }
+        if (PixelKernels::ConvertSameSize(in, format, dst_data, dst_linesize)) {
+            return 0;
+        }
+    }
 
-        frameYUV_->format = TARGET_PIX_FMT;
-        frameYUV_->width = output_width_;
-        frameYUV_->height = output_height_;
+    SwsContextPool::Key key = { in->width, in->height, (AVPixelFormat)in->format,
+                                width, height, format,
+                                SwsContextPool::pickAlgorithm(in->width, in->height, width, height) };
 
-        ret = av_frame_get_buffer(frameYUV_, 0);
-        if (ret < 0) {
-            LOG_ERROR << "Could not av_frame_get_buffer";
+    if (width * height >= gConfig->sliceScalePixels && ThreadPool::GetInstance().available() > 0) {
+        if ((ret = scale_slices(in, key, dst, size)) < 0) {
+            LOG_ERROR << "Could not scale frame in slices: " << av_err2str(ret);
             return ret;
         }
-        sws_init_ = true;
+        return 0;
     }
 
-    ret = sws_scale(sws_ctx_, (const uint8_t* const*)in->data, in->linesize,
-        0, in->height, frameYUV_->data, frameYUV_->linesize);
-    if (ret != frameYUV_->height) {
+    SwsContextPool::SwsContextPtr sws_ctx = SwsContextPool::GetInstance().acquire(key);
+    if (!sws_ctx) {
+        LOG_ERROR << "Could not create scale context";
+        return AVERROR(ENOMEM);
+    }
+    ret = sws_scale(sws_ctx.get(), (const uint8_t* const*)in->data, in->linesize,
+        0, in->height, dst_data, dst_linesize);
+    if (ret != height) {
         LOG_ERROR << "Could not sws_scale frame";
         return ret;
     }
-    *out = frameYUV_;
     return 0;
 }
 
+// Large frames are cut into horizontal bands of output rows, each band is produced by its own
+// SwsContext on the shared ThreadPool. Every context sees the whole source frame, so filters
+// that read across band borders give the same result as a single sws_scale call.
+int FfmpegWrapper::scale_slices(AVFrame* in, const SwsContextPool::Key& key, uint8_t* dst, int size) {
+    int width = key.dst_width;
+    int height = key.dst_height;
+    // threads reserved by encoders are not ours to fan out to
+    int slices = FFMIN(ThreadPool::GetInstance().available() + 1, height / SLICE_MIN_HEIGHT);
+    if (slices < 2) {
+        slices = 1;
+    }
+
+    std::vector<SwsContextPool::SwsContextPtr> sws_ctx;
+    for (int i = 0; i < slices; i++) {
+        sws_ctx.emplace_back(SwsContextPool::GetInstance().acquire(key));
+        if (!sws_ctx.back()) {
+            return AVERROR(ENOMEM);
+        }
+    }
+
+    // the slice API keeps references to both frames, so the send buffer is wrapped
+    // in a buffer ref that does not own it.
+    AVFramePtr out(av_frame_alloc(), [](AVFrame* f) {av_frame_free(&f); });
+    if (!out) {
+        return AVERROR(ENOMEM);
+    }
+    out->buf[0] = av_buffer_create(dst, size, [](void*, uint8_t*) {}, nullptr, 0);
+    if (!out->buf[0]) {
+        return AVERROR(ENOMEM);
+    }
+    out->format = key.dst_format;
+    out->width = width;
+    out->height = height;
+    av_image_fill_arrays(out->data, out->linesize, dst, key.dst_format, width, height, 1);
+
+    // bands must start on a row allowed by the scaler and by chroma subsampling
+    int align = FFMAX((int)sws_receive_slice_alignment(sws_ctx[0].get()), 16);
+    int band = FFALIGN((height + slices - 1) / slices, align);
+
+    std::vector<int> results(slices, 0);
+    ThreadPool::GetInstance().parallelFor(slices, [&](int i) {
+        int start = i * band;
+        int rows = FFMIN(band, height - start);
+        if (rows <= 0) {
+            return;
+        }
+
+        struct SwsContext* ctx = sws_ctx[i].get();
+        int ret = sws_frame_start(ctx, out.get(), in);
+        if (ret >= 0) {
+            ret = sws_send_slice(ctx, 0, in->height);
+        }
+        if (ret >= 0) {
+            ret = sws_receive_slice(ctx, start, rows);
+        }
+        sws_frame_end(ctx);
+        results[i] = ret;
+    });
+
+    for (int ret : results) {
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+int FfmpegWrapper::write_video_header(uint8_t *data, int width, int height, uint32_t ts, uint8_t flags,
+                                      uint8_t motion) {
+    data[0] = (uint8_t)(width >> 8);
+    data[1] = (uint8_t)(width);
+    data[2] = (uint8_t)(height >> 8);
+    data[3] = (uint8_t)(height);
+    data[4] = (uint8_t)(ts >> 24);
+    data[5] = (uint8_t)(ts >> 16);
+    data[6] = (uint8_t)(ts >> 8);
+    data[7] = (uint8_t)(ts);
+    if (header_size_ >= HPP_HEADER_V2_SIZE) {
+        data[8] = (uint8_t)output_format_;
+        data[9] = flags;
+        data[10] = motion;
+        data[11] = 0;
+    }
+    return header_size_;
+}
+
+void FfmpegWrapper::cache_frame(const AVFrame *frame) {
+    std::lock_guard<std::mutex> lk(last_frame_mutex_);
+    av_frame_unref(last_frame_);
+    if (av_frame_ref(last_frame_, frame) < 0) {
+        LOG_WARN << "[" << user_handle_ << "]Could not keep the frame for snapshots";
+    }
+}
+
+// A new output geometry is shown right away by converting the cached frame again, instead of
+// waiting for the next decoded frame. Requests that arrive while one is pending are covered by
+// it, it reads the newest geometry.
+void FfmpegWrapper::request_repaint() {
+    if (output_mode_ != OUTPUT_Raw || ff_video_frame_callback_ || snapshot_interval_ > 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lk(repaint_mutex_);
+        if (repaint_pending_ || stop_request_) {
+            return;
+        }
+        repaint_pending_ = true;
+    }
+    ThreadPool::GetInstance().post([this]() {
+        if (!stop_request_) {
+            repaint_last_frame();
+        }
+        // stopPlay waits for this, nothing of this object is touched afterwards
+        std::lock_guard<std::mutex> lk(repaint_mutex_);
+        repaint_pending_ = false;
+        repaint_cond_.notify_all();
+    });
+}
+
+void FfmpegWrapper::repaint_last_frame() {
+    AVFramePtr frame(av_frame_alloc(), [](AVFrame* f) {av_frame_free(&f); });
+    if (!frame) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lk(last_frame_mutex_);
+        if (!last_frame_->buf[0] || av_frame_ref(frame.get(), last_frame_) < 0) {
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> lk(render_mutex_);
+    render_video_frame(frame.get(), true);
+}
+
 int FfmpegWrapper::output_video_frame(AVFrame *frame) {
-    int ret = 0;
-    AVFrame *tmp_frame = nullptr;
-    AVFrame *tmp_frame2 = nullptr;
+    cache_frame(frame);
+    if (snapshot_interval_ > 0) {
+        return 0;
+    }
 
     // 抽帧
-    if (discard_frame_enabled_ && (++discard_frame_index_ % DISCARD_FRAME_FREQUENCY == 0)) {
+    if (discard_frame_enabled_ && !scrubbing_ && (++discard_frame_index_ % DISCARD_FRAME_FREQUENCY == 0)) {
         return 0;
     }
 
+    std::lock_guard<std::mutex> lk(render_mutex_);
+    return render_video_frame(frame, false);
+}
+
+int FfmpegWrapper::render_video_frame(AVFrame *frame, bool repaint) {
+    int ret = 0;
+    AVFrame *tmp_frame = nullptr;
+
     if ((ret = retrieve_frame(frame, &tmp_frame)) < 0) {
         return ret;
     }
 
-    if ((ret = scale_frame(tmp_frame, &tmp_frame2)) < 0) {
+    // changeVideoResolution may run on another thread, use one geometry for the whole frame
+    Rect crop;
+    int width, height;
+    compute_output_geometry(tmp_frame, &crop, &width, &height);
+    if ((ret = crop_frame(tmp_frame, crop, &tmp_frame)) < 0) {
         return ret;
     }
-
-    int size = av_image_get_buffer_size(TARGET_PIX_FMT, output_width_, output_height_, 1);
-    if (!video_dst_data_) {
-        video_dst_data_ = (uint8_t *) av_malloc(size + HPP_HEADER_SIZE);
-        if (!video_dst_data_) {
-            LOG_ERROR << "Can not alloc buffer";
-            return AVERROR(ENOMEM);
-        }
-    }
+    int size = av_image_get_buffer_size(output_pix_fmt_, width, height, 1);
 
     if (frame->pts == AV_NOPTS_VALUE) {
         frame->pts = 0;
@@ -374,21 +1426,41 @@ int FfmpegWrapper::output_video_frame(AVFrame *frame) {
     }
     current_pts_video_in_ms_ = av_q2d(video_stream_->time_base) * frame->pts * 1000;
 
-    video_dst_data_[0] = (uint8_t)(output_width_ >> 8);
-    video_dst_data_[1] = (uint8_t)(output_width_);
-    video_dst_data_[2] = (uint8_t)(output_height_ >> 8);
-    video_dst_data_[3] = (uint8_t)(output_height_);
-    video_dst_data_[4] = (uint8_t)(current_pts_video_in_ms_ >> 24);
-    video_dst_data_[5] = (uint8_t)(current_pts_video_in_ms_ >> 16);
-    video_dst_data_[6] = (uint8_t)(current_pts_video_in_ms_ >> 8);
-    video_dst_data_[7] = (uint8_t)(current_pts_video_in_ms_);
-
-    ret = av_image_copy_to_buffer(video_dst_data_ + HPP_HEADER_SIZE, size,
-                                  (const uint8_t *const *) tmp_frame2->data,
-                                  (const int *) tmp_frame2->linesize, TARGET_PIX_FMT,
-                                  output_width_, output_height_, 1);
+    if (ff_video_frame_callback_) {
+        ret = ff_video_frame_callback_(tmp_frame, width, height);
+        av_frame_unref(crop_frame_);
+        return ret;
+    }
+
+    if (output_mode_ == OUTPUT_Transcode) {
+        ret = encode_video_frame(tmp_frame, width, height);
+        av_frame_unref(crop_frame_);
+        return ret;
+    }
+
+    // static scenes skip conversion and sending, the score is taken on the cropped frame
+    int motion = 0;
+    if (motion_ && repaint) {
+        motion = last_motion_;
+    } else if (motion_) {
+        motion = motion_->update(tmp_frame);
+        if (!motion_->shouldOutput(motion, av_gettime_relative())) {
+            av_frame_unref(crop_frame_);
+            return 0;
+        }
+        motion = last_motion_ = motion < 0 ? 100 : motion;
+    }
+
+    // the frame is written once into pooled storage, which is then handed over to the
+    // websocket connection as the message payload.
+    std::string buf = BufferPool::GetInstance().acquire(size + header_size_);
+    uint8_t *video_dst_data = (uint8_t *) &buf[0];
+    write_video_header(video_dst_data, width, height, current_pts_video_in_ms_, 0, (uint8_t)motion);
+
+    ret = scale_frame(tmp_frame, width, height, output_pix_fmt_, video_dst_data + header_size_, size);
+    av_frame_unref(crop_frame_);
     if (ret < 0) {
-        LOG_ERROR << "Can not copy image to buffer: " << av_err2str(ret);
+        BufferPool::GetInstance().release(std::move(buf));
         return ret;
     }
 
@@ -396,30 +1468,319 @@ int FfmpegWrapper::output_video_frame(AVFrame *frame) {
     if (0) {
         FILE *fp = nullptr;
         char file[128] = { 0 };
-        snprintf(file, sizeof(file), "%s_%d_%d.yuv", av_get_pix_fmt_name(TARGET_PIX_FMT), output_width_, output_height_);
+        snprintf(file, sizeof(file), "%s_%d_%d.yuv", av_get_pix_fmt_name(output_pix_fmt_), width, height);
 #ifdef WIN32
         fopen_s(&fp, file, "ab");
 #else
 	    fp = fopen("420P.yuv", "ab");
 #endif
         if (fp) {
-            fwrite(video_dst_data_ + HPP_HEADER_SIZE, size, 1, fp);
+            fwrite(video_dst_data + header_size_, size, 1, fp);
             fclose(fp);
         }
     }
 
-    if (ff_send_data_callback_ && user_data_) {
-        if ((ret = ff_send_data_callback_(user_data_, user_handle_,
-                                          video_dst_data_, size + HPP_HEADER_SIZE)) != 0) {
+    // each stage works on the payload of the previous one and keeps the header
+    if (delta_) {
+        std::string packed;
+        if (delta_->encode(video_dst_data + header_size_, size, width, height, output_pix_fmt_, header_size_, &packed)) {
+            memcpy(&packed[0], video_dst_data, header_size_);
+            packed[9] = (char)(packed[9] | HPP_FLAG_DELTA);
+            BufferPool::GetInstance().release(std::move(buf));
+            buf = std::move(packed);
+            video_dst_data = (uint8_t *) &buf[0];
+        }
+    }
+
+    if (compressor_) {
+        std::string packed;
+        int payload_size = (int)buf.size() - header_size_;
+        if (compressor_->compress(video_dst_data + header_size_, payload_size, header_size_, &packed)) {
+            memcpy(&packed[0], video_dst_data, header_size_);
+            packed[9] = (char)(packed[9] | HPP_FLAG_LZ4);
+            BufferPool::GetInstance().release(std::move(buf));
+            buf = std::move(packed);
+        }
+    }
+
+    if (ff_send_data_callback_ && user_data_ && !stop_request_) {
+        if ((ret = ff_send_data_callback_(user_data_, user_handle_, std::move(buf))) != 0) {
+            // the reference already holds the blocks the client did not get
+            if (delta_) {
+                delta_->requestFull();
+            }
 //             if (_ff_exception_callback) {
 //                 _ff_exception_callback(_user_data, _user_handle, ret, (uint8_t*)GetErrorInfo(ret));
 //             }
         }
     }
+    // a frame the connection did not take (e.g. send buffer overflow) goes back to the pool
+    BufferPool::GetInstance().release(std::move(buf));
+
+    return 0;
+}
+
+// Packets are forwarded in Annex-B with the parameter sets in front of every keyframe, so the
+// browser can start decoding at any keyframe.
+int FfmpegWrapper::open_video_passthrough(int *stream_idx) {
+    int ret = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (ret < 0) {
+        LOG_ERROR << "Could not find video stream in input " << inputUrl_;
+        return ret;
+    }
+    AVStream *st = fmt_ctx_->streams[ret];
+    const AVCodecParameters *par = st->codecpar;
+
+    const char *filters = TsWriter::AnnexBFilters(par);
+    if (!filters) {
+        LOG_ERROR << "Codec " << avcodec_get_name(par->codec_id) << " can not be passed through";
+        return AVERROR(ENOSYS);
+    }
+
+    if ((ret = av_bsf_list_parse_str(filters, &bsf_ctx_)) < 0 ||
+        (ret = avcodec_parameters_copy(bsf_ctx_->par_in, par)) < 0) {
+        LOG_ERROR << "Could not create bitstream filter " << filters << ": " << av_err2str(ret);
+        return ret;
+    }
+    bsf_ctx_->time_base_in = st->time_base;
+    if ((ret = av_bsf_init(bsf_ctx_)) < 0) {
+        LOG_ERROR << "Could not init bitstream filter " << filters << ": " << av_err2str(ret);
+        return ret;
+    }
+    if (!(bsf_pkt_ = av_packet_alloc())) {
+        return AVERROR(ENOMEM);
+    }
+
+    codec_string_ = codec_string(par);
+    LOG_INFO << "[" << user_handle_ << "]passthrough " << codec_string_ << " through " << filters;
+    *stream_idx = st->index;
+    return 0;
+}
+
+int FfmpegWrapper::output_video_packet(AVPacket *pkt) {
+    int ret = av_bsf_send_packet(bsf_ctx_, pkt->data ? pkt : nullptr);
+    if (ret < 0) {
+        LOG_ERROR << "Error filtering packet: " << av_err2str(ret);
+        return ret;
+    }
+
+    while ((ret = av_bsf_receive_packet(bsf_ctx_, bsf_pkt_)) >= 0) {
+        ret = send_video_packet(bsf_pkt_, video_stream_->time_base,
+                                video_stream_->codecpar->width, video_stream_->codecpar->height);
+        av_packet_unref(bsf_pkt_);
+    }
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+int FfmpegWrapper::send_video_packet(const AVPacket *pkt, AVRational time_base, int width, int height) {
+    AVRational ms = { 1, 1000 };
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : dts;
+    uint32_t pts_ms = pts != AV_NOPTS_VALUE ? (uint32_t)av_rescale_q(pts, time_base, ms) : 0;
+    uint32_t dts_ms = dts != AV_NOPTS_VALUE ? (uint32_t)av_rescale_q(dts, time_base, ms) : 0;
+    current_pts_video_in_ms_ = pts_ms;
+
+    size_t codec_size = codec_string_.size();
+    size_t header_size = HPP_PACKET_HEADER_SIZE + codec_size;
+    std::string buf = BufferPool::GetInstance().acquire(header_size + pkt->size);
+    uint8_t *data = (uint8_t *) &buf[0];
+    data[0] = (uint8_t)(width >> 8);
+    data[1] = (uint8_t)(width);
+    data[2] = (uint8_t)(height >> 8);
+    data[3] = (uint8_t)(height);
+    AV_WB32(data + 4, pts_ms);
+    AV_WB32(data + 8, dts_ms);
+    data[12] = (pkt->flags & AV_PKT_FLAG_KEY) ? HPP_PACKET_FLAG_KEY : 0;
+    data[13] = (uint8_t)codec_size;
+    memcpy(data + HPP_PACKET_HEADER_SIZE, codec_string_.data(), codec_size);
+    memcpy(data + header_size, pkt->data, pkt->size);
+
+    if (ff_send_data_callback_ && user_data_ && !stop_request_) {
+        ff_send_data_callback_(user_data_, user_handle_, std::move(buf));
+    }
+    BufferPool::GetInstance().release(std::move(buf));
+    return 0;
+}
+
+// The encoder follows the output geometry, a resolution change reopens it and starts with a keyframe.
+int FfmpegWrapper::open_encoder(int width, int height) {
+    close_encoder();
+
+    const AVCodec *codec = FindH264Encoder();
+    if (!codec) {
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    if (!(enc_ctx_ = avcodec_alloc_context3(codec))) {
+        return AVERROR(ENOMEM);
+    }
+
+    // NV12 saves a plane copy inside x264, openh264 only takes yuv420p
+    enc_ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
+    for (const enum AVPixelFormat *p = codec->pix_fmts; p && *p != AV_PIX_FMT_NONE; p++) {
+        if (*p == AV_PIX_FMT_NV12) {
+            enc_ctx_->pix_fmt = AV_PIX_FMT_NV12;
+            break;
+        }
+    }
+    enc_ctx_->width = width;
+    enc_ctx_->height = height;
+    enc_ctx_->time_base = { 1, 1000 };
+    if (video_stream_->avg_frame_rate.num > 0 && video_stream_->avg_frame_rate.den > 0) {
+        enc_ctx_->framerate = video_stream_->avg_frame_rate;
+    }
+    enc_ctx_->bit_rate = (int64_t)enc_bitrate_ * 1000;
+    enc_ctx_->rc_max_rate = enc_ctx_->bit_rate;
+    enc_ctx_->rc_buffer_size = (int)enc_ctx_->bit_rate;
+    enc_ctx_->gop_size = enc_gop_;
+    enc_ctx_->max_b_frames = 0;
+
+    // the encoder's own threads count against the worker budget shared with the scalers
+    int wanted = FFMIN(width * height / ENCODE_PIXELS_PER_THREAD, ENCODE_THREADS_MAX - 1);
+    enc_threads_ = wanted > 0 ? ThreadPool::GetInstance().reserve(wanted) : 0;
+    enc_ctx_->thread_count = 1 + enc_threads_;
+
+    AVDictionary *opts = nullptr;
+    if (!strcmp(codec->name, "libx264")) {
+        av_dict_set(&opts, "preset", enc_preset_.c_str(), 0);
+        av_dict_set(&opts, "tune", "zerolatency", 0);
+    }
+    int ret = avcodec_open2(enc_ctx_, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        LOG_ERROR << "Could not open encoder " << codec->name << ": " << av_err2str(ret);
+        close_encoder();
+        return ret;
+    }
 
+    enc_buf_size_ = av_image_get_buffer_size(enc_ctx_->pix_fmt, width, height, 1);
+    if (!(enc_buf_pool_ = av_buffer_pool_init(enc_buf_size_, nullptr))) {
+        close_encoder();
+        return AVERROR(ENOMEM);
+    }
+    if ((!enc_frame_ && !(enc_frame_ = av_frame_alloc())) || (!enc_pkt_ && !(enc_pkt_ = av_packet_alloc()))) {
+        close_encoder();
+        return AVERROR(ENOMEM);
+    }
+    codec_string_.clear();
+    enc_last_pts_ = AV_NOPTS_VALUE;
+
+    LOG_INFO << "[" << user_handle_ << "]transcode " << codec->name << " " << width << "x" << height
+             << " " << enc_bitrate_ << "kbps gop:" << enc_gop_ << " threads:" << enc_ctx_->thread_count;
     return 0;
 }
 
+void FfmpegWrapper::close_encoder() {
+    avcodec_free_context(&enc_ctx_);
+    av_buffer_pool_uninit(&enc_buf_pool_);
+    if (enc_threads_ > 0) {
+        ThreadPool::GetInstance().unreserve(enc_threads_);
+        enc_threads_ = 0;
+    }
+}
+
+// The frame is scaled straight into a pooled, refcounted encoder input buffer, so the encoder
+// can keep a reference without a copy.
+int FfmpegWrapper::encode_video_frame(AVFrame *in, int width, int height) {
+    int ret = 0;
+    width &= ~1;
+    height &= ~1;
+    if (!enc_ctx_ || enc_ctx_->width != width || enc_ctx_->height != height) {
+        if ((ret = open_encoder(width, height)) < 0) {
+            return ret;
+        }
+    }
+
+    AVBufferRef *buf = av_buffer_pool_get(enc_buf_pool_);
+    if (!buf) {
+        return AVERROR(ENOMEM);
+    }
+    enc_frame_->buf[0] = buf;
+    enc_frame_->format = enc_ctx_->pix_fmt;
+    enc_frame_->width = width;
+    enc_frame_->height = height;
+    av_image_fill_arrays(enc_frame_->data, enc_frame_->linesize, buf->data, enc_ctx_->pix_fmt, width, height, 1);
+    // pts in ms, strictly increasing even if the source repeats a timestamp
+    int64_t pts = current_pts_video_in_ms_;
+    if (enc_last_pts_ != AV_NOPTS_VALUE && pts <= enc_last_pts_) {
+        pts = enc_last_pts_ + 1;
+    }
+    enc_frame_->pts = enc_last_pts_ = pts;
+
+    ret = scale_frame(in, width, height, enc_ctx_->pix_fmt, buf->data, enc_buf_size_);
+    if (ret >= 0) {
+        ret = avcodec_send_frame(enc_ctx_, enc_frame_);
+    }
+    av_frame_unref(enc_frame_);
+    if (ret < 0) {
+        LOG_ERROR << "Error encoding frame: " << av_err2str(ret);
+        return ret;
+    }
+
+    while ((ret = avcodec_receive_packet(enc_ctx_, enc_pkt_)) >= 0) {
+        if (codec_string_.empty() || (enc_pkt_->flags & AV_PKT_FLAG_KEY)) {
+            std::string codec = codec_string_from_sps(enc_pkt_->data, enc_pkt_->size);
+            if (!codec.empty()) {
+                codec_string_ = codec;
+            }
+        }
+        send_video_packet(enc_pkt_, enc_ctx_->time_base, width, height);
+        av_packet_unref(enc_pkt_);
+    }
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+// avc1 codec string from the first SPS of an Annex-B packet, empty if it carries none
+std::string FfmpegWrapper::codec_string_from_sps(const uint8_t *data, int size) {
+    for (int i = 0; i + 6 < size; i++) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1 && (data[i + 3] & 0x1f) == 7) {
+            char str[16] = { 0 };
+            snprintf(str, sizeof(str), "avc1.%02X%02X%02X", data[i + 4], data[i + 5], data[i + 6]);
+            return str;
+        }
+    }
+    return std::string();
+}
+
+// RFC 6381 codec string, as expected by VideoDecoder.configure
+std::string FfmpegWrapper::codec_string(const AVCodecParameters *par) {
+    char str[64] = { 0 };
+    const uint8_t *extradata = par->extradata;
+    if (par->codec_id == AV_CODEC_ID_H264) {
+        if (par->extradata_size >= 4 && extradata[0] == 1) {
+            // avcC: profile, constraint flags, level
+            snprintf(str, sizeof(str), "avc1.%02X%02X%02X", extradata[1], extradata[2], extradata[3]);
+        } else {
+            int constraint = (par->profile & FF_PROFILE_H264_CONSTRAINED) ? 0x40 : 0;
+            snprintf(str, sizeof(str), "avc1.%02X%02X%02X", par->profile & 0xff, constraint,
+                     par->level > 0 ? par->level : 0x28);
+        }
+    } else {
+        if (par->extradata_size >= 13 && extradata[0] == 1) {
+            // hvcC: general profile space/tier/idc, compatibility flags, constraint flags, level
+            static const char *spaces[] = { "", "A", "B", "C" };
+            uint32_t compat = AV_RB32(extradata + 2);
+            uint32_t reversed = 0;
+            for (int i = 0; i < 32; i++) {
+                reversed |= ((compat >> i) & 1) << (31 - i);
+            }
+            int len = snprintf(str, sizeof(str), "hev1.%s%d.%X.%c%d", spaces[extradata[1] >> 6],
+                               extradata[1] & 0x1f, reversed, (extradata[1] & 0x20) ? 'H' : 'L', extradata[12]);
+            int last = 11;
+            while (last >= 6 && extradata[last] == 0) {
+                last--;
+            }
+            for (int i = 6; i <= last && len < (int)sizeof(str) - 4; i++) {
+                len += snprintf(str + len, sizeof(str) - len, ".%02X", extradata[i]);
+            }
+        } else {
+            int profile = par->profile > 0 ? par->profile : FF_PROFILE_HEVC_MAIN;
+            snprintf(str, sizeof(str), "hev1.%d.%X.L%d.B0", profile, 1u << profile,
+                     par->level > 0 ? par->level : 120);
+        }
+    }
+    return str;
+}
+
 int FfmpegWrapper::output_audio_frame(AVFrame *frame) {
     int ret = 0;
     if (!swr_init_ &&
@@ -523,6 +1884,53 @@ int FfmpegWrapper::decode_packet(AVCodecContext *dec, const AVPacket *pkt, AVFra
     return 0;
 }
 
+// The cached GOP goes to the decoder first, all but its last packet marked discard, so the
+// decoder catches up without output and only the latest picture is shown. Packets of the
+// publisher follow until unsubscribe.
+int FfmpegWrapper::prime_from_gop_cache() {
+    std::vector<AVPacket *> gop;
+    int id = GopCache::GetInstance().subscribe(inputUrl_, video_stream_->codecpar, video_stream_->time_base,
+                                               &gop, [this](AVPacket *pkt) {
+        video_packet_queue_.put(pkt);
+    });
+    for (size_t i = 0; i < gop.size(); i++) {
+        if (i + 1 < gop.size()) {
+            gop[i]->flags |= AV_PKT_FLAG_DISCARD;
+        }
+        video_packet_queue_.put(gop[i]);
+        av_packet_free(&gop[i]);
+    }
+    if (id) {
+        LOG_INFO << "[" << user_handle_ << "]primed decoder with " << gop.size() << " cached packets";
+    }
+    return id;
+}
+
+// Snapshot only sessions decode a single keyframe per interval. The decoder is drained right
+// after it, so the picture comes out without waiting for the following packets, and flushed
+// for the next keyframe.
+int FfmpegWrapper::decode_keyframe(const AVPacket *pkt, AVFrame *frame) {
+    if (!pkt->data) {
+        return decode_packet(video_dec_ctx_, pkt, frame);
+    }
+    int64_t now = av_gettime_relative();
+    if (!(pkt->flags & AV_PKT_FLAG_KEY) || now < next_snapshot_us_) {
+        return 0;
+    }
+    next_snapshot_us_ = now + snapshot_interval_ * 1000000LL;
+    return decode_still(pkt, frame);
+}
+
+// a keyframe decoded on its own, for snapshots and scrubbing
+int FfmpegWrapper::decode_still(const AVPacket *pkt, AVFrame *frame) {
+    int ret = decode_packet(video_dec_ctx_, pkt, frame);
+    if (ret >= 0) {
+        ret = decode_packet(video_dec_ctx_, nullptr, frame);
+    }
+    avcodec_flush_buffers(video_dec_ctx_);
+    return ret;
+}
+
 int FfmpegWrapper::open_codec_context(int *stream_idx,
                                       AVCodecContext **dec_ctx, AVFormatContext *fmt_ctx, enum AVMediaType type) {
     int ret = 0;
@@ -575,20 +1983,41 @@ int FfmpegWrapper::open_codec_context(int *stream_idx,
     return 0;
 }
 
-int FfmpegWrapper::open_input_url(const char *inputUrl, int useTCP, int retryTimes) {
+int FfmpegWrapper::OpenInputUrl(const char *inputUrl, int useTCP, int retryTimes, const AVIOInterruptCB &interrupt,
+                                IoDeadline *deadline, AVFormatContext **fmt_ctx, std::unique_ptr<MappedInput> *mapped) {
     int ret = 0;
     AVDictionary* format_options = nullptr;
+
+    // local files are read from a memory mapping. playlists are left to the file protocol,
+    // they change while a recording runs.
+    std::string path;
+    bool local = KeyframeIndex::LocalPath(inputUrl, &path);
+    if (local && !av_match_ext(path.c_str(), "m3u8")) {
+        mapped->reset(new MappedInput());
+        if (!(*mapped)->open(path)) {
+            mapped->reset();
+        }
+    }
     do {
         av_dict_set(&format_options, "rtsp_transport", useTCP ? "tcp" : "udp", 0);
-        if (!(fmt_ctx_ = avformat_alloc_context())) {
+        // socket buffers and reordering of network inputs, options a protocol does not have are ignored
+        for (const auto &option : gConfig->inputOptions) {
+            if (!local) {
+                av_dict_set(&format_options, option.first.c_str(), option.second.c_str(), 0);
+            }
+        }
+        if (!(*fmt_ctx = avformat_alloc_context())) {
             LOG_ERROR << "avformat_alloc_context error";
             ret = -1;
             break;
         }
-        fmt_ctx_->interrupt_callback.callback = input_interrupt_cb;
-        fmt_ctx_->interrupt_callback.opaque = &preTime_;
-        preTime_ = time(nullptr);
-        if ((ret = avformat_open_input(&fmt_ctx_, inputUrl, NULL, &format_options)) == 0) {
+        (*fmt_ctx)->interrupt_callback = interrupt;
+        if (*mapped) {
+            avio_seek((*mapped)->context(), 0, SEEK_SET);
+            (*fmt_ctx)->pb = (*mapped)->context();
+        }
+        deadline->arm(IoDeadline::IO_Open);
+        if ((ret = avformat_open_input(fmt_ctx, inputUrl, NULL, &format_options)) == 0) {
             break;
         }
         // try another mode
@@ -599,7 +2028,9 @@ int FfmpegWrapper::open_input_url(const char *inputUrl, int useTCP, int retryTim
             break;
         }
         av_usleep(10000);
-    } while (!stop_request_);
+        // the next attempt gets a budget of its own, only a stop ends the retries
+        deadline->disarm();
+    } while (!interrupt.callback(interrupt.opaque));
     av_dict_free(&format_options);
 
     return ret;
@@ -608,7 +2039,8 @@ int FfmpegWrapper::open_input_url(const char *inputUrl, int useTCP, int retryTim
 int FfmpegWrapper::hw_decoder_init(AVCodecContext *ctx) {
     int ret = 0;
 
-    if ((ret = av_hwdevice_ctx_create(&hw_device_ctx_, device_type_, NULL, NULL, 0)) < 0) {
+    // one device for every decoder of the session, e.g. after a switch
+    if (!hw_device_ctx_ && (ret = av_hwdevice_ctx_create(&hw_device_ctx_, device_type_, NULL, NULL, 0)) < 0) {
         LOG_ERROR << "Failed to create specified HW device.";
         return ret;
     }
@@ -631,6 +2063,8 @@ int FfmpegWrapper::hw_decoder_open(const AVCodec* dec, AVCodecContext* ctx)
 #endif
 
     ctx->get_format = hw_get_format;
+    // one surface stays referenced by the snapshot cache
+    ctx->extra_hw_frames = 1;
     if (hw_decoder_init(ctx) < 0) {
         return -1;
     }
@@ -693,11 +2127,38 @@ void FfmpegWrapper::audio_decode_thread() {
     try {
         AVPacketPtr pkt(av_packet_alloc(), [](AVPacket* p) {av_packet_free(&p);});
         AVFramePtr frame(av_frame_alloc(), [](AVFrame* f) {av_frame_free(&f);});
+        bool muted = false;
+        int serial = 0;
         do {
             if (stop_request_)
                 break;
-            if ((ret = audio_packet_queue_.get(pkt.get())) < 0)
+            int pkt_serial = 0;
+            if ((ret = audio_packet_queue_.get(pkt.get(), &pkt_serial)) < 0)
                 break;
+            wait_while_paused();
+            // first packet of a switched input
+            bool switched = pkt_serial != serial;
+            serial = pkt_serial;
+            if (audio_flush_.exchange(false) || switched) {
+                avcodec_flush_buffers(audio_dec_ctx_);
+                if (audio_dev_ >= 2) {
+                    SDL_ClearQueuedAudio(audio_dev_);
+                }
+            }
+
+            // no time stretching, audio is left out at other rates
+            if (rate_ != 1.0 && pkt->data) {
+                if (!muted) {
+                    muted = true;
+                    avcodec_flush_buffers(audio_dec_ctx_);
+                    if (audio_dev_ >= 2) {
+                        SDL_ClearQueuedAudio(audio_dev_);
+                    }
+                }
+                av_packet_unref(pkt.get());
+                continue;
+            }
+            muted = false;
 
             ret = decode_packet(audio_dec_ctx_, pkt.get(), frame.get());
             av_packet_unref(pkt.get());
@@ -721,17 +2182,72 @@ void FfmpegWrapper::video_decode_thread() {
         AVPacketPtr pkt(av_packet_alloc(), [](AVPacket* p) {av_packet_free(&p); });
         AVFramePtr frame(av_frame_alloc(), [](AVFrame* f) {av_frame_free(&f); });
         std::chrono::steady_clock::time_point tp = std::chrono::steady_clock::now();
+        double rate = 1.0;
+        bool skipped = false;   // packets were left out, decoding restarts at a keyframe
+        int serial = 0;
         do {
             if (stop_request_)
                 break;
-            if ((ret = video_packet_queue_.get(pkt.get())) < 0)
+            int pkt_serial = 0;
+            if ((ret = video_packet_queue_.get(pkt.get(), &pkt_serial)) < 0)
                 break;
+            // first packet of a switched input, the decoder handed over with it takes its place
+            if (pkt_serial != serial) {
+                serial = pkt_serial;
+                change_video_decoder();
+                apply_rate(rate);
+                skipped = false;
+                tp = std::chrono::steady_clock::now();
+            }
+            // pacing starts over after a pause or a seek
+            if (wait_while_paused()) {
+                tp = std::chrono::steady_clock::now();
+            }
+            if (video_flush_.exchange(false)) {
+                if (video_dec_ctx_) {
+                    avcodec_flush_buffers(video_dec_ctx_);
+                }
+                if (bsf_ctx_) {
+                    av_bsf_flush(bsf_ctx_);
+                }
+                tp = std::chrono::steady_clock::now();
+            }
+            if (rate != rate_) {
+                rate = rate_;
+                apply_rate(rate);
+            }
+            AVRational frame_rate = video_stream_->avg_frame_rate;
+            if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+                frame_rate = { FRAME_RATE_DEFAULT, 1 };
+            }
+            int duration = (int)(1000000 / av_q2d(frame_rate) / rate);
 
-            ret = decode_packet(video_dec_ctx_, pkt.get(), frame.get());
+            // packets left out still count on the pacing clock, the next keyframe waits for them
+            bool key = pkt->flags & AV_PKT_FLAG_KEY;
+            if (key) {
+                skipped = false;
+            }
+            if ((rate > RATE_NONKEY_MIN || skipped) && pkt->data && !key && !scrubbing_) {
+                skipped = true;
+                tp += std::chrono::microseconds(duration);
+                av_packet_unref(pkt.get());
+                continue;
+            }
+
+            if (output_mode_ == OUTPUT_Packet) {
+                ret = output_video_packet(pkt.get());
+            } else if (snapshot_interval_ > 0) {
+                ret = decode_keyframe(pkt.get(), frame.get());
+            } else if (scrubbing_ && pkt->data) {
+                ret = decode_still(pkt.get(), frame.get());
+            } else {
+                ret = decode_packet(video_dec_ctx_, pkt.get(), frame.get());
+            }
+            // packets that only prime the decoder and scrub frames are decoded as fast as possible
+            bool paced = !(pkt->flags & AV_PKT_FLAG_DISCARD) && !scrubbing_;
             av_packet_unref(pkt.get());
 
-            if (true) {
-                int duration = 1000000 / av_q2d(video_stream_->avg_frame_rate);
+            if (paced) {
                 tp += std::chrono::microseconds(duration);
                 std::this_thread::sleep_until(tp);
             }
@@ -748,12 +2264,23 @@ void FfmpegWrapper::video_decode_thread() {
     }
 }
 
+// blocking opens and reads give up at once when the session is stopped or a switch is ready,
+// or when the budget of the operation runs out
 int FfmpegWrapper::input_interrupt_cb(void *ctx) {
-    time_t preTime = *((time_t *) ctx);
-    time_t nowTime = time(nullptr);
-    if (nowTime - preTime > 10) {
-        LOG_ERROR << "input_interrupt_cb timeOut";
+    FfmpegWrapper *wrapper = (FfmpegWrapper *) ctx;
+    if (wrapper->stop_request_ || wrapper->switch_ready_) {
+        return true;
+    }
+    if (wrapper->deadline_.expired()) {
+        LOG_ERROR << "[" << wrapper->user_handle_ << "]input_interrupt_cb "
+                  << IoDeadline::Name(wrapper->deadline_.operation()) << " timeOut";
         return true;
     }
     return false;
 }
+
+// the input of a switch also gives up when the switch is cancelled, the current input plays on
+int FfmpegWrapper::prepared_interrupt_cb(void *ctx) {
+    PreparedInput *input = (PreparedInput *) ctx;
+    return input->owner->stop_request_ || input->cancel || input->deadline.expired();
+}
@@ -2,19 +2,34 @@
 #define FFMPEG_WRAPPER_H
 
 #include <mutex>
+#include <atomic>
 #include <thread>
+#include <vector>
+#include <string>
 #include <functional>
 #include <condition_variable>
 #include "packetQueue.h"
+#include "swsContextPool.h"
+#include "frameCompressor.h"
+#include "deltaEncoder.h"
+#include "motionDetector.h"
+#include "imageEncoder.h"
+#include "recorder.h"
+#include "keyframeIndex.h"
+#include "mappedInput.h"
+#include "standbyPool.h"
+#include "ioDeadline.h"
 
 #define SDL_MAIN_HANDLED
 #include <SDL.h>
 
 extern "C" {
 #include <libavutil/imgutils.h>
+#include <libavutil/intreadwrite.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
 #include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libavutil/fifo.h>
@@ -37,8 +52,35 @@ av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR
 av_ts_make_time_string((char*)__builtin_alloca(AV_TS_MAX_STRING_SIZE), ts, tb)
 #endif
 
-typedef std::function<int(void *user, uintptr_t handle, uint8_t *data, size_t length)> FF_RAW_DATA_CALLBACK;
+// data is the whole message (header + image), the callee may take it over by moving from it.
+typedef std::function<int(void *user, uintptr_t handle, std::string &&data)> FF_RAW_DATA_CALLBACK;
 typedef std::function<int(void *user, uintptr_t handle, int err_code, const uint8_t *err_desc)> FF_EXCEPTION_CALLBACK;
+// frame is the decoded (and cropped) picture, width and height the output size it should be scaled to.
+typedef std::function<int(AVFrame *frame, int width, int height)> FF_VIDEO_FRAME_CALLBACK;
+// url is the input the session plays from now on.
+typedef std::function<void(const std::string &url)> FF_SWITCH_CALLBACK;
+
+// how the decoded picture is fitted into the requested output size
+typedef enum fit_mode {
+    FIT_Stretch = 0,    // exactly the requested size, aspect ratio is not kept
+    FIT_Contain,        // whole picture inside the requested size, aspect ratio kept
+    FIT_Cover,          // requested size filled, aspect ratio kept, edges cropped
+} FitMode;
+
+// pixel format of OUTPUT_Raw frames, the value is carried in the extended frame header
+typedef enum output_format {
+    FORMAT_NV12 = 0,
+    FORMAT_I420,
+    FORMAT_GRAY8,       // luma only, for thumbnails
+    FORMAT_RGBA,        // for renderers without NV12 support
+} OutputFormat;
+
+// what is sent to the client for the video stream
+typedef enum output_mode {
+    OUTPUT_Raw = 0,     // decoded and scaled NV12 frames
+    OUTPUT_Packet,      // compressed Annex-B packets, decoded by the browser (WebCodecs)
+    OUTPUT_Transcode,   // decoded, scaled and encoded again to H.264 on CPU, sent like OUTPUT_Packet
+} OutputMode;
 
 class FfmpegWrapper {
 public:
@@ -53,18 +95,131 @@ public:
     int setCallback(void *user, uintptr_t handle, 
         const FF_RAW_DATA_CALLBACK &pfn, const FF_EXCEPTION_CALLBACK& pfn2);
 
+    // must be called before startPlay. decoded frames go to pfn instead of being scaled and
+    // sent by this wrapper, e.g. for the mosaic compositor.
+    int setVideoFrameCallback(const FF_VIDEO_FRAME_CALLBACK &pfn);
+
     int startPlay(const char *inputUrl, int width, int height,
                   int useGPU = 1, int useTCP = 1, int retryTimes = 3);
 
     int stopPlay();
 
+    // the first half of stopPlay, returns right away: blocking reads are interrupted, no more
+    // frames are sent and the threads start to exit. stopPlay then only waits for them.
+    void requestStop();
+
+    // width or height 0: decoded size
     int changeVideoResolution(int width, int height);
 
+    // FitMode, applies to the next frame
+    int setFitMode(int fitMode);
+
+    // region of interest in fractions of the decoded picture (0.0 ~ 1.0), the region is
+    // cropped before scaling so only it is converted and sent. width or height 0: whole picture.
+    int setCropRegion(double x, double y, double width, double height);
+
     // discard one frame per two frames, 0: close, 1: open
     int openDiscardFrames(int enabled);
 
+    // OutputMode, must be called before startPlay.
+    int setOutputMode(int mode);
+
+    // OutputFormat, must be called before startPlay. frames then carry the extended header
+    // with the format code, without this call the 8 byte header and NV12 are kept.
+    int setOutputFormat(int format);
+
+    // lossless LZ4 compression of OUTPUT_Raw frames, 0: close, 1: open. must be called
+    // before startPlay, frames then carry the extended header.
+    int setCompression(int enabled);
+
+    // send only the blocks that changed, blockSize 16 or 64, 0: close. threshold is the mean
+    // absolute difference per byte below which a block counts as unchanged, interval the
+    // number of frames between complete frames, 0 keeps the default. must be called before
+    // startPlay, frames then carry the extended header.
+    int setDelta(int blockSize, int threshold, int interval);
+
+    // lower the frame rate to idleFps while the scene is static, threshold is the motion score
+    // (0~100) from which a frame counts as motion, 0 keeps the default. the score of every
+    // frame is sent in the extended header. must be called before startPlay.
+    int setMotionAdaptive(int enabled, int idleFps, int threshold);
+
+    // snapshot only session: decode one keyframe every interval seconds into the latest frame
+    // cache and send no video. must be called before startPlay, 0: continuous decode.
+    int setSnapshotInterval(int seconds);
+
+    // the latest decoded frame as a still image (ImageFormat), scaled to width x height. a size
+    // of 0 keeps the aspect ratio, both 0 the original resolution.
+    int snapshot(int format, int width, int height, int quality, std::string *image, std::string *mime);
+
+    // record the video packets as read, without decoding, into a ring of segments in dir,
+    // see Recorder. segmentSeconds and maxSegments 0 keep the defaults.
+    int startRecord(const std::string &dir, int segmentSeconds, int maxSegments);
+
+    int stopRecord();
+
+    // decoding and output stop while paused, inputs that support it (rtsp) are paused too
+    int pause(int paused);
+
+    // position in milliseconds from the start of the input
+    int seek(int64_t positionMs);
+
+    // while dragging a position slider: only the keyframe at each position is decoded and
+    // shown, nothing else is read. done ends it with a seek to positionMs.
+    int scrub(int64_t positionMs, int done);
+
+    // replace the input of a playing session: url is opened and probed in the background while
+    // the current input plays on, the session changes over at the first keyframe of the new one.
+    // the decoder is kept when codec and geometry match. not for OUTPUT_Packet.
+    // the new input is installed, or never if it fails.
+    int switchInput(const char *inputUrl, int useTCP, const FF_SWITCH_CALLBACK &pfn = nullptr);
+
+    // playback rate of files, 0.25 ~ 16, applies from the next frame. above 2x non-reference
+    // frames are not decoded, above 4x only keyframes; audio is muted while the rate is not 1.
+    int setRate(double rate);
+
+    // the next frame is sent complete, e.g. after the client lost its reference frame
+    int requestFullFrame();
+
+    // OUTPUT_Transcode only, must be called before startPlay. 0 or empty keeps the default.
+    int setTranscodeOptions(int bitrateKbps, int gop, const std::string &preset);
+
+    // libx264, or libopenh264 when x264 is not built in; nullptr if neither is.
+    static const AVCodec *FindH264Encoder();
+
+    // opens inputUrl into fmt_ctx, local files through a mapped input. deadline is armed for each
+    // attempt, interrupt is expected to check it. returns FFOpenUrlFailed after retryTimes attempts.
+    static int OpenInputUrl(const char *inputUrl, int useTCP, int retryTimes, const AVIOInterruptCB &interrupt,
+                            IoDeadline *deadline, AVFormatContext **fmt_ctx, std::unique_ptr<MappedInput> *mapped);
+
 private:
-    int open_input_url(const char *inputUrl, int useTCP, int retryTimes);
+    // an input opened for switchInput, up to its first video keyframe
+    struct PreparedInput {
+        FfmpegWrapper *owner;
+        std::atomic<bool> cancel;
+        IoDeadline deadline;
+        std::unique_ptr<StandbyInput> source;
+        FF_SWITCH_CALLBACK installed;
+        int audio_index;                // -1 if the session's audio decoder does not fit it
+        AVCodecContext *video_dec_ctx;  // nullptr: the current decoder is kept
+
+        PreparedInput(FfmpegWrapper *wrapper, const std::string &inputUrl);
+
+        ~PreparedInput();
+    };
+
+    void prepare_input(PreparedInput *input, int useTCP);
+
+    std::unique_ptr<PreparedInput> take_prepared_input();
+
+    void install_prepared_input(PreparedInput *input, int *video_stream_index, int *audio_stream_index);
+
+    void cancel_switch();
+
+    void change_video_decoder();
+
+    void queue_input_packets(std::vector<AVPacket *> *packets, int video_stream_index, int audio_stream_index);
+
+    static int prepared_interrupt_cb(void *ctx);
 
     int hw_decoder_init(AVCodecContext *ctx);
 
@@ -76,10 +231,67 @@ private:
 
     int retrieve_frame(AVFrame* in, AVFrame** out);
 
-    int scale_frame(AVFrame* in, AVFrame** out);
+    struct Rect {
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    void compute_output_geometry(const AVFrame* in, Rect* crop, int* width, int* height);
+
+    int crop_frame(AVFrame* in, const Rect& crop, AVFrame** out);
+
+    int scale_frame(AVFrame* in, int width, int height, enum AVPixelFormat format, uint8_t* dst, int size);
+
+    int scale_slices(AVFrame* in, const SwsContextPool::Key& key, uint8_t* dst, int size);
 
     int output_video_frame(AVFrame *frame);
 
+    int render_video_frame(AVFrame *frame, bool repaint);
+
+    void request_repaint();
+
+    void repaint_last_frame();
+
+    void cache_frame(const AVFrame *frame);
+
+    int decode_keyframe(const AVPacket *pkt, AVFrame *frame);
+
+    int prime_from_gop_cache();
+
+    int seek_input(int64_t position_ms);
+
+    void trim_live_queues(bool *wait_keyframe);
+
+    void apply_rate(double rate);
+
+    int seek_by_index(int64_t position_ms);
+
+    void open_keyframe_index();
+
+    int decode_still(const AVPacket *pkt, AVFrame *frame);
+
+    bool wait_while_paused();
+
+    int write_video_header(uint8_t *data, int width, int height, uint32_t ts, uint8_t flags, uint8_t motion);
+
+    int open_video_passthrough(int *stream_idx);
+
+    int output_video_packet(AVPacket *pkt);
+
+    int send_video_packet(const AVPacket *pkt, AVRational time_base, int width, int height);
+
+    int open_encoder(int width, int height);
+
+    void close_encoder();
+
+    int encode_video_frame(AVFrame *in, int width, int height);
+
+    static std::string codec_string(const AVCodecParameters *par);
+
+    static std::string codec_string_from_sps(const uint8_t *data, int size);
+
     int output_audio_frame(AVFrame *frame);
 
     int decode_packet(AVCodecContext *dec, const AVPacket *pkt, AVFrame *frame);
@@ -103,19 +315,46 @@ private:
     static enum AVPixelFormat hw_pix_fmt_;
 
     AVFormatContext *fmt_ctx_;
-    time_t preTime_;
+    std::unique_ptr<MappedInput> mapped_input_;     // custom I/O of local files, outlives fmt_ctx_
+    std::unique_ptr<IoInterrupt> interrupt_;        // of an input opened by others, outlives fmt_ctx_
+    IoDeadline deadline_;       // of the open or read the read thread is in
 
     AVCodecContext *video_dec_ctx_;
     AVCodecContext *audio_dec_ctx_;
 
-    bool sws_init_;
-    struct SwsContext *sws_ctx_;
-
     bool swr_init_;
     struct SwrContext* swr_ctx_;
 
-    int output_width_;
-    int output_height_;
+    std::mutex output_mutex_;
+    int request_width_;
+    int request_height_;
+    int fit_mode_;
+    double roi_x_;
+    double roi_y_;
+    double roi_width_;
+    double roi_height_;
+
+    int output_mode_;
+    int output_format_;
+    enum AVPixelFormat output_pix_fmt_;
+    int header_size_;
+    std::unique_ptr<FrameCompressor> compressor_;
+    std::unique_ptr<DeltaEncoder> delta_;
+    std::unique_ptr<MotionDetector> motion_;
+    AVBSFContext *bsf_ctx_;
+    AVPacket *bsf_pkt_;
+    std::string codec_string_;
+
+    AVCodecContext *enc_ctx_;
+    AVFrame *enc_frame_;
+    AVPacket *enc_pkt_;
+    AVBufferPool *enc_buf_pool_;
+    int enc_buf_size_;
+    int enc_threads_;
+    int64_t enc_last_pts_;
+    int enc_bitrate_;
+    int enc_gop_;
+    std::string enc_preset_;
 
     uint32_t current_pts_audio_in_ms_;
     uint32_t current_pts_video_in_ms_;
@@ -127,15 +366,61 @@ private:
     PacketQueue video_packet_queue_;
 
     AVFrame *sw_frame_;
-    AVFrame *frameYUV_;
+    AVFrame *crop_frame_;
+
+    // latest decoded frame for snapshots, a reference to the decoder's (hardware) frame
+    std::mutex last_frame_mutex_;
+    AVFrame *last_frame_;
+    int snapshot_interval_;
+    int64_t next_snapshot_us_;
+
+    // frames are rendered by the decode thread and by repaints on the ThreadPool
+    std::mutex render_mutex_;
+    std::mutex repaint_mutex_;
+    std::condition_variable repaint_cond_;
+    bool repaint_pending_;
+    int last_motion_;
+
+    std::mutex recorder_mutex_;
+    std::unique_ptr<Recorder> recorder_;
+
+    // requests of the API thread, carried out by the read and decode threads
+    std::mutex pause_mutex_;
+    std::condition_variable pause_cond_;
+    std::atomic<bool> paused_;
+    std::atomic<int64_t> seek_request_ms_;
+    std::atomic<bool> video_flush_;
+    std::atomic<bool> audio_flush_;
+    std::atomic<bool> scrubbing_;
+    std::atomic<int64_t> scrub_request_ms_;
+    std::atomic<double> rate_;
+    std::atomic<bool> live_;
+
+    // keyframes of a local file, loaded or built on the first open
+    std::mutex index_mutex_;
+    std::shared_ptr<KeyframeIndex> index_;
+    std::thread index_thread_;
+    std::atomic<bool> index_abort_;
+
+    // switchInput: prepared on switch_thread_, installed by the read thread, packets of every
+    // input carry a serial of their own so the decode threads know where the new one starts
+    std::mutex switch_mutex_;
+    std::thread switch_thread_;
+    std::unique_ptr<PreparedInput> switch_input_;
+    std::atomic<bool> switch_ready_;
+    AVCodecContext *switch_dec_ctx_;        // from the read thread to the video decode thread
+    AVFormatContext *retired_fmt_ctx_;      // the previous input, decode threads may still use its streams
+    std::unique_ptr<MappedInput> retired_mapped_;
+    std::unique_ptr<IoInterrupt> retired_interrupt_;
+    int serial_;
 
-    uint8_t *video_dst_data_;
     uint8_t *audio_dst_data_;
 
     std::thread audio_decode_thread_handle_;
     std::thread video_decode_thread_handle_;
     std::thread main_read_thread_handle_;
-    int stop_request_;
+    std::atomic<int> stop_request_;
+    bool stopped_;
     int discard_frame_enabled_;
     uint32_t discard_frame_index_;
 
@@ -143,6 +428,7 @@ private:
     uintptr_t user_handle_;
     FF_RAW_DATA_CALLBACK ff_send_data_callback_;
     FF_EXCEPTION_CALLBACK ff_exception_callback_;
+    FF_VIDEO_FRAME_CALLBACK ff_video_frame_callback_;
 
     SDL_AudioDeviceID audio_dev_;
 };
@@ -0,0 +1,206 @@
+#include "frameCompressor.h"
+#include <vector>
+#include <cstring>
+#include "log.h"
+#include "threadPool.h"
+#include "bufferPool.h"
+
+extern "C" {
+#include <libavutil/time.h>
+#include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
+}
+
+constexpr int LZ4_MIN_MATCH = 4;
+constexpr int LZ4_LAST_LITERALS = 5;
+constexpr int LZ4_MF_LIMIT = 12;
+constexpr int LZ4_HASH_LOG = 12;
+constexpr int LZ4_MAX_DISTANCE = 65535;
+constexpr int LZ4_SKIP_STRENGTH = 6;
+
+constexpr int COMPRESS_HEADER_SIZE = 8;
+// a frame that keeps more than this share of its size is not worth the CPU
+constexpr double COMPRESS_POOR_RATIO = 0.9;
+constexpr int COMPRESS_POOR_FRAMES = 10;
+constexpr int COMPRESS_BACKOFF_FRAMES = 250;
+constexpr int64_t COMPRESS_STATS_INTERVAL_US = 10 * 1000000LL;
+
+FrameCompressor::FrameCompressor(uintptr_t handle) : handle_(handle), poor_frames_(0), skip_frames_(0),
+                                                     stats_start_(av_gettime_relative()), stats_frames_(0),
+                                                     stats_compressed_(0), stats_raw_bytes_(0),
+                                                     stats_sent_bytes_(0), stats_time_us_(0) {
+}
+
+FrameCompressor::~FrameCompressor() = default;
+
+int FrameCompressor::Bound(int size) {
+    return size + size / 255 + 16;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline uint8_t *lz4_write_length(uint8_t *op, int length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Greedy single-pass compressor with a 4K entry hash table, the same scheme as LZ4's fast
+// mode. The output never exceeds Bound(size), which is checked once up front.
+int FrameCompressor::CompressBlock(const uint8_t *src, int size, uint8_t *dst, int capacity) {
+    if (capacity < Bound(size)) {
+        return 0;
+    }
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + size;
+    uint8_t *op = dst;
+
+    if (size > LZ4_MF_LIMIT) {
+        const uint8_t *mf_limit = end - LZ4_MF_LIMIT;
+        const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+        std::vector<uint32_t> table(1 << LZ4_HASH_LOG, 0);
+
+        ip++;
+        while (ip < mf_limit) {
+            uint32_t sequence = AV_RN32(ip);
+            uint32_t h = lz4_hash(sequence);
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ip - ref > LZ4_MAX_DISTANCE || AV_RN32(ref) != sequence) {
+                // step faster through data that does not match
+                ip += 1 + ((ip - anchor) >> LZ4_SKIP_STRENGTH);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + LZ4_MIN_MATCH;
+            const uint8_t *rp = ref + LZ4_MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            int literals = (int)(ip - anchor);
+            int match = (int)(mp - ip) - LZ4_MIN_MATCH;
+            int offset = (int)(ip - ref);
+            uint8_t *token = op++;
+            if (literals >= 15) {
+                *token = 15 << 4;
+                op = lz4_write_length(op, literals - 15);
+            } else {
+                *token = (uint8_t)(literals << 4);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (uint8_t)(offset);
+            *op++ = (uint8_t)(offset >> 8);
+            if (match >= 15) {
+                *token |= 15;
+                op = lz4_write_length(op, match - 15);
+            } else {
+                *token |= (uint8_t)match;
+            }
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    int literals = (int)(end - anchor);
+    if (literals >= 15) {
+        *op++ = 15 << 4;
+        op = lz4_write_length(op, literals - 15);
+    } else {
+        *op++ = (uint8_t)(literals << 4);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return (int)(op - dst);
+}
+
+bool FrameCompressor::compress(const uint8_t *payload, int size, int header_size, std::string *out) {
+    if (skip_frames_ > 0) {
+        skip_frames_--;
+        update_stats(size, size, 0, false);
+        return false;
+    }
+
+    int64_t start = av_gettime_relative();
+    int chunks = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    if (chunks <= 0 || chunks > 0xffff) {
+        return false;
+    }
+    int table_size = COMPRESS_HEADER_SIZE + 4 * chunks;
+    int chunk_bound = Bound(CHUNK_SIZE);
+
+    // chunks are compressed into fixed slots and packed afterwards
+    *out = BufferPool::GetInstance().acquire(header_size + table_size + (size_t)chunk_bound * chunks);
+    uint8_t *base = (uint8_t *) &(*out)[0] + header_size;
+    uint8_t *slots = base + table_size;
+    std::vector<int> sizes(chunks, 0);
+    ThreadPool::GetInstance().parallelFor(chunks, [&](int i) {
+        int offset = i * CHUNK_SIZE;
+        int length = FFMIN(CHUNK_SIZE, size - offset);
+        sizes[i] = CompressBlock(payload + offset, length, slots + (size_t)i * chunk_bound, chunk_bound);
+    });
+
+    AV_WB32(base, size);
+    AV_WB16(base + 4, chunks);
+    AV_WB16(base + 6, 0);
+    uint8_t *op = slots;
+    for (int i = 0; i < chunks; i++) {
+        AV_WB32(base + COMPRESS_HEADER_SIZE + 4 * i, sizes[i]);
+        if (op != slots + (size_t)i * chunk_bound) {
+            memmove(op, slots + (size_t)i * chunk_bound, sizes[i]);
+        }
+        op += sizes[i];
+    }
+    int compressed_size = (int)(op - base);
+    int64_t elapsed = av_gettime_relative() - start;
+
+    if (compressed_size > size * COMPRESS_POOR_RATIO) {
+        if (++poor_frames_ >= COMPRESS_POOR_FRAMES) {
+            LOG_INFO << "[" << handle_ << "]frames do not compress, pause compression for "
+                     << COMPRESS_BACKOFF_FRAMES << " frames";
+            poor_frames_ = 0;
+            skip_frames_ = COMPRESS_BACKOFF_FRAMES;
+        }
+        BufferPool::GetInstance().release(std::move(*out));
+        update_stats(size, size, elapsed, false);
+        return false;
+    }
+
+    poor_frames_ = 0;
+    out->resize(header_size + compressed_size);
+    update_stats(size, compressed_size, elapsed, true);
+    return true;
+}
+
+void FrameCompressor::update_stats(int raw_size, int sent_size, int64_t elapsed_us, bool compressed) {
+    stats_frames_++;
+    stats_compressed_ += compressed ? 1 : 0;
+    stats_raw_bytes_ += raw_size;
+    stats_sent_bytes_ += sent_size;
+    stats_time_us_ += elapsed_us;
+
+    int64_t now = av_gettime_relative();
+    if (now - stats_start_ < COMPRESS_STATS_INTERVAL_US) {
+        return;
+    }
+    LOG_INFO << "[" << handle_ << "]lz4 frames:" << stats_compressed_ << "/" << stats_frames_
+             << ", bytes:" << stats_raw_bytes_ << "->" << stats_sent_bytes_
+             << ", ratio:" << (stats_raw_bytes_ ? (double)stats_sent_bytes_ / stats_raw_bytes_ : 1.0)
+             << ", cpu:" << (stats_frames_ ? stats_time_us_ / stats_frames_ : 0) << "us/frame";
+    stats_start_ = now;
+    stats_frames_ = stats_compressed_ = stats_raw_bytes_ = stats_sent_bytes_ = stats_time_us_ = 0;
+}
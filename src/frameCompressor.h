@@ -0,0 +1,49 @@
+#ifndef __FRAME_COMPRESSOR_H__
+#define __FRAME_COMPRESSOR_H__
+
+#include <string>
+#include <cstdint>
+
+// Lossless compression of raw frame payloads for clients on slow links. The payload is cut
+// into chunks that are compressed in parallel on the shared ThreadPool, each chunk is an
+// independent LZ4 block. Compression switches itself off for a while when the content does
+// not compress (e.g. noisy scenes), and statistics are logged periodically so CPU time can
+// be compared against bytes saved.
+//
+// compressed payload layout:
+// raw size(4) chunk count(2) reserved(2) compressed size of each chunk(4 * count) chunks...
+// every chunk but the last holds CHUNK_SIZE raw bytes. integers are big endian.
+class FrameCompressor {
+public:
+    static constexpr int CHUNK_SIZE = 256 * 1024;
+
+    explicit FrameCompressor(uintptr_t handle);
+
+    virtual ~FrameCompressor();
+
+    // on success out holds header_size reserved bytes followed by the compressed payload,
+    // false if the frame should be sent uncompressed.
+    bool compress(const uint8_t *payload, int size, int header_size, std::string *out);
+
+    // LZ4 block format, returns the compressed size, 0 if capacity < Bound(size)
+    static int CompressBlock(const uint8_t *src, int size, uint8_t *dst, int capacity);
+
+    static int Bound(int size);
+
+private:
+    void update_stats(int raw_size, int sent_size, int64_t elapsed_us, bool compressed);
+
+private:
+    uintptr_t handle_;
+    int poor_frames_;       // consecutive frames that did not compress well
+    int skip_frames_;       // frames left to send uncompressed before trying again
+
+    int64_t stats_start_;
+    int64_t stats_frames_;
+    int64_t stats_compressed_;
+    int64_t stats_raw_bytes_;
+    int64_t stats_sent_bytes_;
+    int64_t stats_time_us_;
+};
+
+#endif // __FRAME_COMPRESSOR_H__
@@ -0,0 +1,145 @@
+#include "gopCache.h"
+#include <cstring>
+#include "config.h"
+#include "log.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// how long the GOP of a url stays after its publisher stopped
+constexpr int64_t GOP_CACHE_LINGER_US = 10 * 1000000LL;
+
+GopCache &GopCache::GetInstance() {
+    static GopCache instance;
+    return instance;
+}
+
+GopCache::~GopCache() {
+    for (auto &item : entries_) {
+        clear(&item.second);
+        avcodec_parameters_free(&item.second.par);
+    }
+}
+
+void GopCache::clear(Entry *entry) {
+    for (AVPacket *pkt : entry->packets) {
+        av_packet_free(&pkt);
+    }
+    entry->packets.clear();
+    entry->bytes = 0;
+}
+
+bool GopCache::compatible(const AVCodecParameters *a, const AVCodecParameters *b) {
+    return a && b && a->codec_id == b->codec_id && a->width == b->width && a->height == b->height &&
+           a->extradata_size == b->extradata_size &&
+           (a->extradata_size == 0 || memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+}
+
+void GopCache::prune(int64_t now) {
+    for (auto iter = entries_.begin(); iter != entries_.end();) {
+        Entry &entry = iter->second;
+        if (!entry.owner && entry.subscribers.empty() && now - entry.idle_since > GOP_CACHE_LINGER_US) {
+            clear(&entry);
+            avcodec_parameters_free(&entry.par);
+            iter = entries_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+void GopCache::publish(const std::string &url, const void *owner, const AVCodecParameters *par,
+                       AVRational time_base, const AVPacket *pkt) {
+    if (gConfig->gopCacheBytes <= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(mutex_);
+    Entry &entry = entries_[url];
+    if (entry.owner != owner) {
+        if (entry.owner) {
+            return;
+        }
+        // a new connection, what was cached or forwarded does not continue into its packets
+        entry.owner = owner;
+        clear(&entry);
+        entry.subscribers.clear();
+        entry.overflow = false;
+        avcodec_parameters_free(&entry.par);
+        if ((entry.par = avcodec_parameters_alloc())) {
+            avcodec_parameters_copy(entry.par, par);
+        }
+        entry.time_base = time_base;
+    }
+
+    for (auto &item : entry.subscribers) {
+        AVPacket *copy = av_packet_clone(pkt);
+        if (copy) {
+            av_packet_rescale_ts(copy, entry.time_base, item.second.time_base);
+            item.second.fn(copy);
+            av_packet_free(&copy);
+        }
+    }
+
+    if (pkt->flags & AV_PKT_FLAG_KEY) {
+        clear(&entry);
+        entry.overflow = false;
+    } else if (entry.overflow || entry.packets.empty()) {
+        return;
+    }
+    if (entry.bytes + pkt->size > (size_t)gConfig->gopCacheBytes) {
+        LOG_INFO << "GOP of " << url << " exceeds " << gConfig->gopCacheBytes << " bytes, not cached";
+        clear(&entry);
+        entry.overflow = true;
+        return;
+    }
+    AVPacket *copy = av_packet_clone(pkt);
+    if (copy) {
+        entry.packets.push_back(copy);
+        entry.bytes += copy->size;
+    }
+}
+
+void GopCache::unpublish(const std::string &url, const void *owner) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto iter = entries_.find(url);
+    if (iter == entries_.end() || iter->second.owner != owner) {
+        return;
+    }
+    iter->second.owner = nullptr;
+    iter->second.subscribers.clear();
+    iter->second.idle_since = av_gettime_relative();
+    prune(iter->second.idle_since);
+}
+
+int GopCache::subscribe(const std::string &url, const AVCodecParameters *par, AVRational time_base,
+                        std::vector<AVPacket *> *gop, const PacketCallback &fn) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    prune(av_gettime_relative());
+    auto iter = entries_.find(url);
+    if (iter == entries_.end() || iter->second.packets.empty() || !compatible(iter->second.par, par)) {
+        return 0;
+    }
+
+    Entry &entry = iter->second;
+    for (const AVPacket *pkt : entry.packets) {
+        AVPacket *copy = av_packet_clone(pkt);
+        if (copy) {
+            av_packet_rescale_ts(copy, entry.time_base, time_base);
+            gop->push_back(copy);
+        }
+    }
+    int id = ++next_id_;
+    if (entry.owner) {
+        entry.subscribers[id] = { time_base, fn };
+    }
+    return id;
+}
+
+void GopCache::unsubscribe(const std::string &url, int id) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto iter = entries_.find(url);
+    if (iter != entries_.end()) {
+        iter->second.subscribers.erase(id);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __GOP_CACHE_H__
+#define __GOP_CACHE_H__
+
+#include <map>
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <string>
+#include <functional>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+// Video packets of live inputs from the last keyframe on, per url, so that a new viewer of the
+// same url starts without waiting for the next keyframe. One session at a time publishes the
+// packets of its connection. A new session takes the cached GOP to prime its decoder and then
+// follows the publisher's packets until its own connection reaches a keyframe.
+// The cache of a url is bounded by gConfig->gopCacheBytes and kept for a while after the
+// publisher stopped, so that layout switches (stop, then play again) also start at once.
+class GopCache {
+public:
+    using PacketCallback = std::function<void(AVPacket *)>;
+
+    static GopCache &GetInstance();
+
+    virtual ~GopCache();
+
+    // packet read by owner from url. the first owner that publishes to a url without publisher
+    // takes it over, packets of other owners are ignored.
+    void publish(const std::string &url, const void *owner, const AVCodecParameters *par,
+                 AVRational time_base, const AVPacket *pkt);
+
+    void unpublish(const std::string &url, const void *owner);
+
+    // returns an id for unsubscribe, 0 if nothing usable is cached. gop receives new packets
+    // (caller frees them) from the cached keyframe on, fn is called with every later packet
+    // of the publisher until unsubscribe. packets are rescaled to time_base.
+    int subscribe(const std::string &url, const AVCodecParameters *par, AVRational time_base,
+                  std::vector<AVPacket *> *gop, const PacketCallback &fn);
+
+    void unsubscribe(const std::string &url, int id);
+
+private:
+    GopCache() = default;
+
+    struct Subscriber {
+        AVRational time_base;
+        PacketCallback fn;
+    };
+
+    struct Entry {
+        const void *owner = nullptr;
+        AVCodecParameters *par = nullptr;
+        AVRational time_base = { 0, 1 };
+        std::deque<AVPacket *> packets;
+        size_t bytes = 0;
+        bool overflow = false;      // GOP larger than the budget, wait for the next keyframe
+        int64_t idle_since = 0;     // when the publisher left
+        std::map<int, Subscriber> subscribers;
+    };
+
+    static void clear(Entry *entry);
+
+    static bool compatible(const AVCodecParameters *a, const AVCodecParameters *b);
+
+    void prune(int64_t now);
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    int next_id_ = 0;
+};
+
+#endif // __GOP_CACHE_H__
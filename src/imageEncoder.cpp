@@ -0,0 +1,157 @@
+#include "imageEncoder.h"
+#include <memory>
+#include "error.h"
+#include "swsContextPool.h"
+#include "ffmpegWrapper.h"     // av_err2str for C++
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/adler32.h>
+#include <libavutil/crc.h>
+#include <libavutil/intreadwrite.h>
+}
+
+constexpr int IMAGE_QUALITY_DEFAULT = 80;
+// largest stored deflate block
+constexpr int PNG_STORED_BLOCK_MAX = 65535;
+
+int ImageEncoder::Encode(const AVFrame *in, int width, int height, int format, int quality,
+                         std::string *out, std::string *mime) {
+    const AVCodec *codec = nullptr;
+    enum AVPixelFormat pix_fmt = AV_PIX_FMT_RGB24;
+    if (format == IMAGE_Jpeg) {
+        if (!(codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG))) {
+            return FFEncoderNotFound;
+        }
+        pix_fmt = AV_PIX_FMT_YUVJ420P;
+        *mime = "image/jpeg";
+    } else if (format == IMAGE_Png) {
+        codec = avcodec_find_encoder(AV_CODEC_ID_PNG);
+        *mime = "image/png";
+    } else {
+        return InvalidParameter;
+    }
+
+    std::unique_ptr<AVFrame, void (*)(AVFrame *)> dst(av_frame_alloc(), [](AVFrame *f) { av_frame_free(&f); });
+    if (!dst) {
+        return AVERROR(ENOMEM);
+    }
+    dst->format = pix_fmt;
+    dst->width = width;
+    dst->height = height;
+    int ret = av_frame_get_buffer(dst.get(), 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    SwsContextPool::Key key = { in->width, in->height, (AVPixelFormat)in->format, width, height, pix_fmt,
+                                SwsContextPool::pickAlgorithm(in->width, in->height, width, height) };
+    SwsContextPool::SwsContextPtr sws_ctx = SwsContextPool::GetInstance().acquire(key);
+    if (!sws_ctx) {
+        LOG_ERROR << "Could not create scale context";
+        return AVERROR(ENOMEM);
+    }
+    ret = sws_scale(sws_ctx.get(), (const uint8_t *const *)in->data, in->linesize, 0, in->height,
+                    dst->data, dst->linesize);
+    if (ret != height) {
+        LOG_ERROR << "Could not sws_scale snapshot";
+        return AVERROR(EINVAL);
+    }
+
+    if (codec) {
+        return encode_with_codec(dst.get(), codec->id, quality > 0 ? quality : IMAGE_QUALITY_DEFAULT, out);
+    }
+    write_png(dst.get(), out);
+    return 0;
+}
+
+int ImageEncoder::encode_with_codec(AVFrame *frame, int codec_id, int quality, std::string *out) {
+    const AVCodec *codec = avcodec_find_encoder((enum AVCodecID)codec_id);
+    std::unique_ptr<AVCodecContext, void (*)(AVCodecContext *)> ctx(
+            avcodec_alloc_context3(codec), [](AVCodecContext *c) { avcodec_free_context(&c); });
+    std::unique_ptr<AVPacket, void (*)(AVPacket *)> pkt(av_packet_alloc(), [](AVPacket *p) { av_packet_free(&p); });
+    if (!ctx || !pkt) {
+        return AVERROR(ENOMEM);
+    }
+    ctx->width = frame->width;
+    ctx->height = frame->height;
+    ctx->pix_fmt = (AVPixelFormat)frame->format;
+    ctx->time_base = { 1, 25 };
+    if (codec_id == AV_CODEC_ID_MJPEG) {
+        // qscale 2 (best) ~ 31 (worst)
+        ctx->flags |= AV_CODEC_FLAG_QSCALE;
+        ctx->global_quality = FF_QP2LAMBDA * (2 + (100 - FFMIN(quality, 100)) * 29 / 99);
+    }
+
+    int ret = avcodec_open2(ctx.get(), codec, nullptr);
+    if (ret < 0) {
+        LOG_ERROR << "Could not open " << codec->name << " encoder: " << av_err2str(ret);
+        return ret;
+    }
+    frame->quality = ctx->global_quality;
+    if ((ret = avcodec_send_frame(ctx.get(), frame)) < 0 ||
+        (ret = avcodec_send_frame(ctx.get(), nullptr)) < 0 ||
+        (ret = avcodec_receive_packet(ctx.get(), pkt.get())) < 0) {
+        LOG_ERROR << "Could not encode snapshot: " << av_err2str(ret);
+        return ret;
+    }
+    out->assign((const char *)pkt->data, pkt->size);
+    return 0;
+}
+
+static void png_chunk(std::string *out, const char *type, const uint8_t *data, size_t size) {
+    uint8_t head[8];
+    AV_WB32(head, (uint32_t)size);
+    memcpy(head + 4, type, 4);
+    out->append((const char *)head, 8);
+    out->append((const char *)data, size);
+
+    const AVCRC *table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    uint32_t crc = av_crc(table, UINT32_MAX, (const uint8_t *)type, 4);
+    crc = av_crc(table, crc, data, size) ^ UINT32_MAX;
+    uint8_t tail[4];
+    AV_WB32(tail, crc);
+    out->append((const char *)tail, 4);
+}
+
+// RGB24, filter type 0 on every row, zlib stream made of stored blocks
+void ImageEncoder::write_png(const AVFrame *rgb, std::string *out) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    int row_size = 1 + rgb->width * 3;
+    size_t raw_size = (size_t)row_size * rgb->height;
+
+    std::string raw(raw_size, '\0');
+    for (int y = 0; y < rgb->height; y++) {
+        memcpy(&raw[(size_t)y * row_size + 1], rgb->data[0] + (size_t)y * rgb->linesize[0], rgb->width * 3);
+    }
+
+    size_t blocks = (raw_size + PNG_STORED_BLOCK_MAX - 1) / PNG_STORED_BLOCK_MAX;
+    std::string zlib;
+    zlib.reserve(2 + raw_size + blocks * 5 + 4);
+    zlib.push_back((char)0x78);
+    zlib.push_back((char)0x01);
+    for (size_t offset = 0; offset < raw_size; offset += PNG_STORED_BLOCK_MAX) {
+        uint16_t len = (uint16_t)FFMIN((size_t)PNG_STORED_BLOCK_MAX, raw_size - offset);
+        uint8_t head[5] = { (uint8_t)(offset + len == raw_size ? 1 : 0),
+                            (uint8_t)len, (uint8_t)(len >> 8), (uint8_t)~len, (uint8_t)(~len >> 8) };
+        zlib.append((const char *)head, 5);
+        zlib.append(raw, offset, len);
+    }
+    uint8_t adler[4];
+    AV_WB32(adler, (uint32_t)av_adler32_update(1, (const uint8_t *)raw.data(), raw_size));
+    zlib.append((const char *)adler, 4);
+
+    uint8_t ihdr[13];
+    AV_WB32(ihdr, rgb->width);
+    AV_WB32(ihdr + 4, rgb->height);
+    ihdr[8] = 8;    // bit depth
+    ihdr[9] = 2;    // truecolor
+    ihdr[10] = 0;
+    ihdr[11] = 0;
+    ihdr[12] = 0;
+
+    out->assign((const char *)signature, 8);
+    png_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk(out, "IDAT", (const uint8_t *)zlib.data(), zlib.size());
+    png_chunk(out, "IEND", nullptr, 0);
+}
@@ -0,0 +1,32 @@
+#ifndef __IMAGE_ENCODER_H__
+#define __IMAGE_ENCODER_H__
+
+#include <string>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+typedef enum image_format {
+    IMAGE_Jpeg = 0,
+    IMAGE_Png,
+} ImageFormat;
+
+// Still images of decoded frames. JPEG needs the mjpeg encoder of FFmpeg. PNG uses FFmpeg's
+// encoder when it is built in, otherwise a small writer with uncompressed deflate blocks,
+// which is larger but works with any FFmpeg build.
+class ImageEncoder {
+public:
+    // in is a software frame of any pixel format, scaled to width x height. quality 1~100 (JPEG).
+    // returns 0 or an ErrorType/AVERROR code, mime is set to the content type of out.
+    static int Encode(const AVFrame *in, int width, int height, int format, int quality,
+                      std::string *out, std::string *mime);
+
+private:
+    static int encode_with_codec(AVFrame *frame, int codec_id, int quality, std::string *out);
+
+    static void write_png(const AVFrame *rgb, std::string *out);
+};
+
+#endif // __IMAGE_ENCODER_H__
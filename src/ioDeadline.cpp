@@ -0,0 +1,70 @@
+#include "ioDeadline.h"
+#include <chrono>
+#include "config.h"
+
+static int64_t steady_now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+IoDeadline::IoDeadline() : operation_(IO_None), deadline_us_(INT64_MAX) {
+}
+
+void IoDeadline::arm(Operation op, int min_budget_ms) {
+    int budget_ms = 0;
+    switch (op) {
+    case IO_Open:
+        budget_ms = gConfig->openTimeoutMs;
+        break;
+    case IO_Probe:
+        budget_ms = gConfig->probeTimeoutMs;
+        break;
+    case IO_Read:
+        budget_ms = gConfig->readTimeoutMs;
+        break;
+    default:
+        break;
+    }
+    if (budget_ms > 0 && budget_ms < min_budget_ms) {
+        budget_ms = min_budget_ms;
+    }
+    // a budget of 0 is no budget
+    deadline_us_ = budget_ms > 0 ? steady_now_us() + budget_ms * 1000LL : INT64_MAX;
+    operation_ = op;
+}
+
+void IoDeadline::disarm() {
+    deadline_us_ = INT64_MAX;
+    operation_ = IO_None;
+}
+
+bool IoDeadline::expired() const {
+    return steady_now_us() > deadline_us_;
+}
+
+const char *IoDeadline::Name(Operation op) {
+    switch (op) {
+    case IO_Open:
+        return "open";
+    case IO_Probe:
+        return "probe";
+    case IO_Read:
+        return "read";
+    default:
+        return "none";
+    }
+}
+
+IoInterrupt::IoInterrupt() : target_({ nullptr, nullptr }) {
+}
+
+void IoInterrupt::retarget(const AVIOInterruptCB &target) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    target_ = target;
+}
+
+int IoInterrupt::interrupt_cb(void *ctx) {
+    IoInterrupt *interrupt = (IoInterrupt *)ctx;
+    std::lock_guard<std::mutex> lk(interrupt->mutex_);
+    return interrupt->target_.callback ? interrupt->target_.callback(interrupt->target_.opaque) : 0;
+}
@@ -0,0 +1,67 @@
+#ifndef __IO_DEADLINE_H__
+#define __IO_DEADLINE_H__
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// Time budget of the blocking operation an input is in, on the steady clock. The thread that
+// opens or reads the input arms it before each operation with the budget configured for that
+// kind of operation, the interrupt callback of the input checks it together with its stop flag.
+// Either side may be on another thread, the state is atomic.
+class IoDeadline {
+public:
+    typedef enum operation {
+        IO_None = 0,
+        IO_Open,        // connect and open, also requests on an open input (pause, play, seek)
+        IO_Probe,       // avformat_find_stream_info
+        IO_Read,        // a single av_read_frame
+    } Operation;
+
+    IoDeadline();
+
+    // op starts now, gConfig has its budget. a configured budget is raised to min_budget_ms,
+    // no budget stays none
+    void arm(Operation op, int min_budget_ms = 0);
+
+    // no budget, nothing expires
+    void disarm();
+
+    bool expired() const;
+
+    Operation operation() const { return (Operation)operation_.load(); }
+
+    static const char *Name(Operation op);
+
+private:
+    std::atomic<int> operation_;
+    std::atomic<int64_t> deadline_us_;  // steady clock
+};
+
+// Interrupt callback of an input that changes hands, e.g. from the standby pool to a session.
+// The protocols an input opens (rtsp, tcp, http) keep a copy of the callback of their own, so
+// the input is opened with this one, which lives as long as the input, and an owner only
+// retargets it.
+class IoInterrupt {
+public:
+    IoInterrupt();
+
+    // the callback to open the input with
+    AVIOInterruptCB callback() { return { interrupt_cb, this }; }
+
+    // target is called from now on, { nullptr, nullptr } interrupts nothing
+    void retarget(const AVIOInterruptCB &target);
+
+private:
+    static int interrupt_cb(void *ctx);
+
+private:
+    std::mutex mutex_;
+    AVIOInterruptCB target_;
+};
+
+#endif // __IO_DEADLINE_H__
@@ -0,0 +1,219 @@
+#include "keyframeIndex.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include "log.h"
+
+extern "C" {
+#include <libavutil/intreadwrite.h>
+#include <libavformat/avformat.h>
+}
+
+constexpr char KFI_MAGIC[] = "HKFI";
+constexpr int KFI_VERSION = 1;
+constexpr int KFI_HEADER_SIZE = 40;
+constexpr int KFI_ENTRY_SIZE = 24;
+constexpr const char *KFI_SUFFIX = ".kfi";
+
+void KeyframeIndex::Builder::add(int64_t pts, int64_t pos, bool key) {
+    if (key && pts != AV_NOPTS_VALUE) {
+        entries_.push_back({ pts, pos, 0, 0 });
+    }
+    if (!entries_.empty()) {
+        entries_.back().gop_frames++;
+    }
+}
+
+std::vector<KeyframeIndex::Entry> KeyframeIndex::Builder::finish(int64_t end_pos) {
+    for (size_t i = 0; i < entries_.size(); i++) {
+        int64_t next = i + 1 < entries_.size() ? entries_[i + 1].pos : end_pos;
+        Entry &entry = entries_[i];
+        entry.gop_bytes = (entry.pos >= 0 && next > entry.pos) ? (uint32_t)FFMIN(next - entry.pos, UINT32_MAX) : 0;
+    }
+    std::stable_sort(entries_.begin(), entries_.end(), [](const Entry &a, const Entry &b) {
+        return a.pts < b.pts;
+    });
+    return std::move(entries_);
+}
+
+KeyframeIndex::KeyframeIndex() : time_base_({ 0, 1 }), entries_(nullptr), count_(0) {
+}
+
+bool KeyframeIndex::LocalPath(const std::string &url, std::string *path) {
+    if (url.compare(0, 5, "file:") == 0) {
+        *path = url.substr(5);
+        return !path->empty();
+    }
+    // a protocol is a scheme followed by "://", drive letters are not
+    size_t colon = url.find("://");
+    if (colon != std::string::npos) {
+        return false;
+    }
+    *path = url;
+    return !path->empty();
+}
+
+std::string KeyframeIndex::SidecarPath(const std::string &path) {
+    return path + KFI_SUFFIX;
+}
+
+static bool file_stamp(const std::string &path, int64_t *size, int64_t *mtime) {
+    std::error_code ec;
+    auto file_size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    auto write_time = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+        return false;
+    }
+    *size = (int64_t)file_size;
+    *mtime = (int64_t)write_time.time_since_epoch().count();
+    return true;
+}
+
+int KeyframeIndex::Save(const std::string &path, AVRational time_base, const std::vector<Entry> &entries) {
+    int64_t size, mtime;
+    if (entries.empty() || !file_stamp(path, &size, &mtime)) {
+        return AVERROR(EINVAL);
+    }
+
+    std::string data(KFI_HEADER_SIZE + entries.size() * KFI_ENTRY_SIZE, '\0');
+    uint8_t *p = (uint8_t *) &data[0];
+    memcpy(p, KFI_MAGIC, 4);
+    AV_WL16(p + 4, KFI_VERSION);
+    AV_WL16(p + 6, KFI_ENTRY_SIZE);
+    AV_WL32(p + 8, time_base.num);
+    AV_WL32(p + 12, time_base.den);
+    AV_WL64(p + 16, size);
+    AV_WL64(p + 24, mtime);
+    AV_WL64(p + 32, entries.size());
+    p += KFI_HEADER_SIZE;
+    for (const Entry &entry : entries) {
+        AV_WL64(p, entry.pts);
+        AV_WL64(p + 8, entry.pos);
+        AV_WL32(p + 16, entry.gop_bytes);
+        AV_WL32(p + 20, entry.gop_frames);
+        p += KFI_ENTRY_SIZE;
+    }
+
+    // a reader never maps a half written sidecar
+    std::string sidecar = SidecarPath(path);
+    std::string tmp = sidecar + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp) {
+        return AVERROR(errno);
+    }
+    bool written = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    std::error_code ec;
+    if (written) {
+        std::filesystem::rename(tmp, sidecar, ec);
+    }
+    if (!written || ec) {
+        std::filesystem::remove(tmp, ec);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
+
+int KeyframeIndex::Build(const std::string &path, const std::atomic<bool> &abort,
+                         AVRational *time_base, std::vector<Entry> *entries) {
+    AVFormatContext *fmt_ctx = avformat_alloc_context();
+    if (!fmt_ctx) {
+        return AVERROR(ENOMEM);
+    }
+    fmt_ctx->interrupt_callback.callback = [](void *opaque) -> int {
+        return *(const std::atomic<bool> *)opaque ? 1 : 0;
+    };
+    fmt_ctx->interrupt_callback.opaque = (void *) &abort;
+
+    int ret = avformat_open_input(&fmt_ctx, path.c_str(), nullptr, nullptr);
+    if (ret < 0) {
+        return ret;
+    }
+    AVPacket *pkt = nullptr;
+    int stream_index = -1;
+    do {
+        if ((ret = avformat_find_stream_info(fmt_ctx, nullptr)) < 0) {
+            break;
+        }
+        if ((ret = stream_index = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0)) < 0) {
+            break;
+        }
+        for (unsigned i = 0; i < fmt_ctx->nb_streams; i++) {
+            if ((int)i != stream_index) {
+                fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+        if (!(pkt = av_packet_alloc())) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+
+        Builder builder;
+        while ((ret = av_read_frame(fmt_ctx, pkt)) >= 0) {
+            if (pkt->stream_index == stream_index) {
+                builder.add(pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts, pkt->pos,
+                            pkt->flags & AV_PKT_FLAG_KEY);
+            }
+            av_packet_unref(pkt);
+        }
+        if (ret != AVERROR_EOF) {
+            break;
+        }
+        ret = builder.empty() ? AVERROR_INVALIDDATA : 0;
+        *time_base = fmt_ctx->streams[stream_index]->time_base;
+        *entries = builder.finish(avio_size(fmt_ctx->pb));
+    } while (0);
+
+    av_packet_free(&pkt);
+    avformat_close_input(&fmt_ctx);
+    return ret;
+}
+
+bool KeyframeIndex::load(const std::string &path) {
+    int64_t size, mtime;
+    if (!file_stamp(path, &size, &mtime) || !file_.open(SidecarPath(path))) {
+        return false;
+    }
+    const uint8_t *p = file_.data();
+    if (file_.size() < KFI_HEADER_SIZE || memcmp(p, KFI_MAGIC, 4) || AV_RL16(p + 4) != KFI_VERSION ||
+        AV_RL16(p + 6) != KFI_ENTRY_SIZE || (int64_t)AV_RL64(p + 16) != size || (int64_t)AV_RL64(p + 24) != mtime) {
+        file_.close();
+        return false;
+    }
+    uint64_t count = AV_RL64(p + 32);
+    if (count == 0 || count > (uint64_t)(file_.size() - KFI_HEADER_SIZE) / KFI_ENTRY_SIZE) {
+        file_.close();
+        return false;
+    }
+    time_base_ = { (int)AV_RL32(p + 8), (int)AV_RL32(p + 12) };
+    entries_ = p + KFI_HEADER_SIZE;
+    count_ = (size_t)count;
+    return time_base_.num > 0 && time_base_.den > 0;
+}
+
+KeyframeIndex::Entry KeyframeIndex::entry(size_t index) const {
+    const uint8_t *p = entries_ + index * KFI_ENTRY_SIZE;
+    return { (int64_t)AV_RL64(p), (int64_t)AV_RL64(p + 8), AV_RL32(p + 16), AV_RL32(p + 20) };
+}
+
+bool KeyframeIndex::find(int64_t pts, Entry *out) const {
+    if (!count_) {
+        return false;
+    }
+    // first entry after pts, the one before it is the keyframe to start from
+    size_t low = 0, high = count_;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entry(mid).pts <= pts) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *out = entry(low > 0 ? low - 1 : 0);
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef __KEYFRAME_INDEX_H__
+#define __KEYFRAME_INDEX_H__
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "mappedFile.h"
+
+extern "C" {
+#include <libavutil/rational.h>
+}
+
+// Keyframes of the video stream of a local file (pts -> byte offset -> GOP size), kept in a
+// sidecar file next to it (<file>.kfi) so a seek goes straight to the byte offset of the right
+// keyframe instead of letting the demuxer search. The sidecar is mapped and searched in place.
+// It is built by scanning the file once on its first open, or by the recorder for each segment
+// it writes, and is ignored when the file's size or modification time changed.
+//
+// sidecar layout, little endian:
+// magic "HKFI"(4) version(2) entry size(2) time base num(4) den(4) file size(8) mtime(8) count(8)
+// entries: pts(8) byte offset(8) GOP bytes(4) GOP frames(4), ordered by pts
+class KeyframeIndex {
+public:
+    struct Entry {
+        int64_t pts;            // time base of the index
+        int64_t pos;            // byte offset of the keyframe's packet
+        uint32_t gop_bytes;     // up to the next keyframe (or the end of the file)
+        uint32_t gop_frames;
+    };
+
+    // collects entries from the packets of the video stream in file order
+    class Builder {
+    public:
+        void add(int64_t pts, int64_t pos, bool key);
+
+        // GOP sizes of the last keyframe are counted up to end_pos
+        std::vector<Entry> finish(int64_t end_pos);
+
+        bool empty() const { return entries_.empty(); }
+
+    private:
+        std::vector<Entry> entries_;
+    };
+
+    KeyframeIndex();
+
+    virtual ~KeyframeIndex() = default;
+
+    // the path of a url that names a local file (plain path or file:), false for anything else
+    static bool LocalPath(const std::string &url, std::string *path);
+
+    static std::string SidecarPath(const std::string &path);
+
+    // writes the sidecar of path, which has to be complete already
+    static int Save(const std::string &path, AVRational time_base, const std::vector<Entry> &entries);
+
+    // scans path with a demuxer of its own, stops early with AVERROR_EXIT when abort is set
+    static int Build(const std::string &path, const std::atomic<bool> &abort,
+                     AVRational *time_base, std::vector<Entry> *entries);
+
+    // maps the sidecar of path, false if there is none or it is stale
+    bool load(const std::string &path);
+
+    // the last keyframe at or before pts, the first one if pts is before all of them
+    bool find(int64_t pts, Entry *entry) const;
+
+    AVRational timeBase() const { return time_base_; }
+
+    size_t size() const { return count_; }
+
+private:
+    Entry entry(size_t index) const;
+
+private:
+    MappedFile file_;
+    AVRational time_base_;
+    const uint8_t *entries_;
+    size_t count_;
+};
+
+#endif // __KEYFRAME_INDEX_H__
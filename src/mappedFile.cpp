@@ -0,0 +1,109 @@
+#include "mappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+MappedFile::MappedFile() : data_(nullptr), size_(0), file_(INVALID_HANDLE_VALUE), mapping_(nullptr) {
+}
+#else
+MappedFile::MappedFile() : data_(nullptr), size_(0) {
+}
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+bool MappedFile::open(const std::string &path) {
+    close();
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER size;
+    if (file_ == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_, &size) || size.QuadPart <= 0) {
+        close();
+        return false;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_ || !(data_ = (const uint8_t *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0))) {
+        close();
+        return false;
+    }
+    size_ = size.QuadPart;
+    return true;
+}
+
+void MappedFile::advise(int64_t offset, int64_t length, Advice advice) const {
+    if (!data_ || advice != ADVISE_WillNeed || offset >= size_) {
+        return;
+    }
+    int64_t end = offset + length < size_ ? offset + length : size_;
+    WIN32_MEMORY_RANGE_ENTRY range = { (PVOID)(data_ + offset), (SIZE_T)(end - offset) };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+}
+
+void MappedFile::close() {
+    if (data_) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_) {
+        CloseHandle(mapping_);
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+}
+#else
+bool MappedFile::open(const std::string &path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+    // the mapping keeps the file referenced
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    data_ = (const uint8_t *)data;
+    size_ = st.st_size;
+    return true;
+}
+
+void MappedFile::advise(int64_t offset, int64_t length, Advice advice) const {
+    if (!data_ || offset >= size_) {
+        return;
+    }
+    // ranges have to start on a page
+    static const int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start = offset / page * page;
+    int64_t end = offset + length < size_ ? offset + length : size_;
+    madvise((void *)(data_ + start), (size_t)(end - start),
+            advice == ADVISE_Sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+}
+
+void MappedFile::close() {
+    if (data_) {
+        munmap((void *)data_, size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+}
+#endif
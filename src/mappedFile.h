@@ -0,0 +1,43 @@
+#ifndef __MAPPED_FILE_H__
+#define __MAPPED_FILE_H__
+
+#include <string>
+#include <cstdint>
+
+// Read-only mapping of a whole file, the pages are shared with the OS page cache.
+class MappedFile {
+public:
+    MappedFile();
+
+    virtual ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // false if the file can not be opened or is empty
+    bool open(const std::string &path);
+
+    void close();
+
+    typedef enum advice {
+        ADVISE_Sequential = 0,  // read ahead aggressively, drop pages behind
+        ADVISE_WillNeed,        // start reading the range in now
+    } Advice;
+
+    // a hint to the OS about the access pattern of a range, nothing happens where unsupported
+    void advise(int64_t offset, int64_t length, Advice advice) const;
+
+    const uint8_t *data() const { return data_; }
+
+    int64_t size() const { return size_; }
+
+private:
+    const uint8_t *data_;
+    int64_t size_;
+#ifdef _WIN32
+    void *file_;
+    void *mapping_;
+#endif
+};
+
+#endif // __MAPPED_FILE_H__
@@ -0,0 +1,93 @@
+#include "mappedInput.h"
+#include <cstring>
+
+extern "C" {
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#include <libavutil/common.h>
+}
+
+constexpr int MAPPED_IO_BUFFER_SIZE = 256 * 1024;
+// prefetched ahead of the read position, renewed when half of it is used up
+constexpr int64_t MAPPED_READ_AHEAD = 16 * 1024 * 1024;
+
+MappedInput::MappedInput() : avio_(nullptr), pos_(0), prefetched_(0) {
+}
+
+MappedInput::~MappedInput() {
+    if (avio_) {
+        av_freep(&avio_->buffer);
+        avio_context_free(&avio_);
+    }
+}
+
+bool MappedInput::open(const std::string &path) {
+    if (!file_.open(path)) {
+        return false;
+    }
+    uint8_t *buffer = (uint8_t *)av_malloc(MAPPED_IO_BUFFER_SIZE);
+    if (!buffer) {
+        file_.close();
+        return false;
+    }
+    avio_ = avio_alloc_context(buffer, MAPPED_IO_BUFFER_SIZE, 0, this, read_packet, nullptr, seek);
+    if (!avio_) {
+        av_free(buffer);
+        file_.close();
+        return false;
+    }
+    file_.advise(0, file_.size(), MappedFile::ADVISE_Sequential);
+    read_ahead();
+    return true;
+}
+
+void MappedInput::read_ahead() {
+    if (pos_ + MAPPED_READ_AHEAD / 2 < prefetched_ || prefetched_ >= file_.size()) {
+        return;
+    }
+    int64_t start = FFMAX(pos_, prefetched_);
+    prefetched_ = FFMIN(pos_ + MAPPED_READ_AHEAD, file_.size());
+    file_.advise(start, prefetched_ - start, MappedFile::ADVISE_WillNeed);
+}
+
+int MappedInput::read_packet(void *opaque, uint8_t *buf, int size) {
+    MappedInput *input = (MappedInput *)opaque;
+    int64_t left = input->file_.size() - input->pos_;
+    if (left <= 0) {
+        return AVERROR_EOF;
+    }
+    size = (int)FFMIN(size, left);
+    memcpy(buf, input->file_.data() + input->pos_, size);
+    input->pos_ += size;
+    input->read_ahead();
+    return size;
+}
+
+int64_t MappedInput::seek(void *opaque, int64_t offset, int whence) {
+    MappedInput *input = (MappedInput *)opaque;
+    int64_t size = input->file_.size();
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += input->pos_;
+        break;
+    case SEEK_END:
+        offset += size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0 || offset > size) {
+        return AVERROR(EINVAL);
+    }
+    // a jump starts a new read-ahead window
+    if (offset < input->pos_ || offset > input->prefetched_) {
+        input->prefetched_ = offset;
+    }
+    input->pos_ = offset;
+    input->read_ahead();
+    return offset;
+}
@@ -0,0 +1,42 @@
+#ifndef __MAPPED_INPUT_H__
+#define __MAPPED_INPUT_H__
+
+#include <string>
+#include <cstdint>
+#include "mappedFile.h"
+
+extern "C" {
+#include <libavformat/avio.h>
+}
+
+// AVIOContext that reads a local file from a memory mapping instead of the file protocol:
+// reads are copies out of the page cache without a syscall each, and the OS is told the
+// access is sequential with a window ahead of the read position prefetched. Seeks only move
+// the position. Meant for complete files, a file that is still growing is seen at the size
+// it had when opened.
+class MappedInput {
+public:
+    MappedInput();
+
+    virtual ~MappedInput();
+
+    // false if path can not be mapped, the file protocol is used then
+    bool open(const std::string &path);
+
+    AVIOContext *context() const { return avio_; }
+
+private:
+    static int read_packet(void *opaque, uint8_t *buf, int size);
+
+    static int64_t seek(void *opaque, int64_t offset, int whence);
+
+    void read_ahead();
+
+private:
+    MappedFile file_;
+    AVIOContext *avio_;
+    int64_t pos_;
+    int64_t prefetched_;        // end of the range prefetched so far
+};
+
+#endif // __MAPPED_INPUT_H__
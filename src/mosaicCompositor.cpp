@@ -0,0 +1,242 @@
+#include "mosaicCompositor.h"
+#include <cmath>
+#include <chrono>
+#include <cstring>
+#include "error.h"
+#include "bufferPool.h"
+#include "swsContextPool.h"
+
+constexpr enum AVPixelFormat MOSAIC_PIX_FMT = AV_PIX_FMT_NV12;
+// extended frame header, format NV12
+constexpr int MOSAIC_HEADER_SIZE = 12;
+constexpr int MOSAIC_FPS_DEFAULT = 25;
+constexpr int MOSAIC_FPS_MAX = 60;
+// limited range black
+constexpr uint8_t MOSAIC_BLACK_Y = 16;
+constexpr uint8_t MOSAIC_BLACK_UV = 128;
+
+MosaicCompositor::MosaicCompositor() : width_(0), height_(0), fps_(MOSAIC_FPS_DEFAULT), dirty_(false),
+                                       stop_request_(false), start_time_(0),
+                                       user_data_(nullptr), user_handle_(0) {
+}
+
+MosaicCompositor::~MosaicCompositor() {
+    stopPlay();
+}
+
+int MosaicCompositor::setCallback(void *user, uintptr_t handle,
+                                  const FF_RAW_DATA_CALLBACK &pfn, const FF_EXCEPTION_CALLBACK &pfn2) {
+    user_data_ = user;
+    user_handle_ = handle;
+    ff_send_data_callback_ = pfn;
+    ff_exception_callback_ = pfn2;
+    return 0;
+}
+
+void MosaicCompositor::GridLayout(int count, int width, int height, std::vector<Cell> *cells) {
+    cells->clear();
+    if (count <= 0) {
+        return;
+    }
+    int cols = (int)std::ceil(std::sqrt((double)count));
+    int rows = (count + cols - 1) / cols;
+    int cell_width = (width / cols) & ~1;
+    int cell_height = (height / rows) & ~1;
+    for (int i = 0; i < count; i++) {
+        cells->push_back({ (i % cols) * cell_width, (i / cols) * cell_height, cell_width, cell_height });
+    }
+}
+
+int MosaicCompositor::startPlay(const std::vector<std::string> &urls, const std::vector<Cell> &cells,
+                                int width, int height, int fps, int useGPU /*= 1*/, int useTCP /*= 1*/) {
+    if (urls.empty() || urls.size() != cells.size() || width <= 0 || height <= 0) {
+        return InvalidParameter;
+    }
+
+    width_ = width & ~1;
+    height_ = height & ~1;
+    fps_ = (fps > 0 && fps <= MOSAIC_FPS_MAX) ? fps : MOSAIC_FPS_DEFAULT;
+
+    // cells start on even pixels and have even sizes, so NV12 chroma stays aligned
+    cells_.clear();
+    for (const Cell &cell : cells) {
+        Cell c = { cell.x & ~1, cell.y & ~1, cell.width & ~1, cell.height & ~1 };
+        if (c.x < 0 || c.y < 0 || c.width <= 0 || c.height <= 0 ||
+            c.x + c.width > width_ || c.y + c.height > height_) {
+            return InvalidParameter;
+        }
+        // cells are written concurrently under a shared lock, see canvas_mutex_
+        for (const Cell &other : cells_) {
+            if (c.x < other.x + other.width && other.x < c.x + c.width &&
+                c.y < other.y + other.height && other.y < c.y + c.height) {
+                return InvalidParameter;
+            }
+        }
+        cells_.push_back(c);
+    }
+    drawn_.assign(cells_.size(), { 0, 0, 0, 0 });
+
+    canvas_.resize(av_image_get_buffer_size(MOSAIC_PIX_FMT, width_, height_, 1));
+    memset(canvas_.data(), MOSAIC_BLACK_Y, (size_t)width_ * height_);
+    memset(canvas_.data() + (size_t)width_ * height_, MOSAIC_BLACK_UV, canvas_.size() - (size_t)width_ * height_);
+    dirty_ = true;
+
+    LOG_INFO << "[" << user_handle_ << "]startPlay mosaic " << width_ << "x" << height_
+             << ", sources:" << urls.size() << ", fps:" << fps_;
+
+    for (size_t i = 0; i < urls.size(); i++) {
+        FfmpegWrapperPtr source = std::make_shared<FfmpegWrapper>();
+        source->setCallback(user_data_, user_handle_, nullptr, ff_exception_callback_);
+        source->setVideoFrameCallback([this, i](AVFrame *frame, int width, int height) -> int {
+            return write_cell((int)i, frame, width, height);
+        });
+        source->setFitMode(FIT_Contain);
+        source->startPlay(urls[i].c_str(), cells_[i].width, cells_[i].height, useGPU, useTCP);
+        sources_.push_back(source);
+    }
+
+    start_time_ = av_gettime_relative();
+    stop_request_ = false;
+    tick_thread_handle_ = std::thread(&MosaicCompositor::tick_thread, this);
+    return 0;
+}
+
+void MosaicCompositor::requestStop() {
+    {
+        std::lock_guard<std::mutex> lk(stop_mutex_);
+        stop_request_ = true;
+    }
+    stop_cond_.notify_all();
+    for (auto &source : sources_) {
+        source->requestStop();
+    }
+}
+
+int MosaicCompositor::stopPlay() {
+    requestStop();
+
+    // sources first, so that no cell is written after the canvas is gone
+    for (auto &source : sources_) {
+        source->stopPlay();
+    }
+    sources_.clear();
+
+    if (tick_thread_handle_.joinable()) {
+        tick_thread_handle_.join();
+    }
+    return 0;
+}
+
+int MosaicCompositor::openDiscardFrames(int enabled) {
+    for (auto &source : sources_) {
+        source->openDiscardFrames(enabled);
+    }
+    return 0;
+}
+
+void MosaicCompositor::clear_rect(const Cell &rect) {
+    for (int y = rect.y; y < rect.y + rect.height; y++) {
+        memset(canvas_.data() + (size_t)y * width_ + rect.x, MOSAIC_BLACK_Y, rect.width);
+    }
+    uint8_t *uv = canvas_.data() + (size_t)width_ * height_;
+    for (int y = rect.y / 2; y < (rect.y + rect.height) / 2; y++) {
+        memset(uv + (size_t)y * width_ + rect.x, MOSAIC_BLACK_UV, rect.width);
+    }
+}
+
+// Called on the decode thread of source index with its output geometry (already fitted into the
+// cell), the picture is scaled straight into the canvas, centred in the cell.
+int MosaicCompositor::write_cell(int index, AVFrame *frame, int width, int height) {
+    const Cell &cell = cells_[index];
+    Cell rect;
+    rect.width = FFMIN(width, cell.width) & ~1;
+    rect.height = FFMIN(height, cell.height) & ~1;
+    rect.x = cell.x + (((cell.width - rect.width) / 2) & ~1);
+    rect.y = cell.y + (((cell.height - rect.height) / 2) & ~1);
+    if (rect.width <= 0 || rect.height <= 0) {
+        return 0;
+    }
+
+    SwsContextPool::Key key = { frame->width, frame->height, (AVPixelFormat)frame->format,
+                                rect.width, rect.height, MOSAIC_PIX_FMT,
+                                SwsContextPool::pickAlgorithm(frame->width, frame->height, rect.width, rect.height) };
+    SwsContextPool::SwsContextPtr sws_ctx = SwsContextPool::GetInstance().acquire(key);
+    if (!sws_ctx) {
+        LOG_ERROR << "Could not create scale context";
+        return AVERROR(ENOMEM);
+    }
+
+    uint8_t *dst_data[4] = {
+        canvas_.data() + (size_t)rect.y * width_ + rect.x,
+        canvas_.data() + (size_t)width_ * height_ + (size_t)(rect.y / 2) * width_ + rect.x,
+        nullptr, nullptr
+    };
+    int dst_linesize[4] = { width_, width_, 0, 0 };
+
+    std::shared_lock<std::shared_mutex> lk(canvas_mutex_);
+    Cell &drawn = drawn_[index];
+    if (drawn.x != rect.x || drawn.y != rect.y || drawn.width != rect.width || drawn.height != rect.height) {
+        clear_rect(cell);
+        drawn = rect;
+    }
+    int ret = sws_scale(sws_ctx.get(), (const uint8_t* const*)frame->data, frame->linesize,
+                        0, frame->height, dst_data, dst_linesize);
+    if (ret != rect.height) {
+        LOG_ERROR << "Could not sws_scale frame into cell " << index;
+        return -1;
+    }
+    dirty_ = true;
+    return 0;
+}
+
+void MosaicCompositor::tick_thread() {
+    const auto interval = std::chrono::microseconds(1000000 / fps_);
+    auto next = std::chrono::steady_clock::now();
+    size_t size = canvas_.size();
+
+    std::unique_lock<std::mutex> stop_lk(stop_mutex_);
+    while (!stop_request_) {
+        next += interval;
+        stop_cond_.wait_until(stop_lk, next, [this] { return stop_request_; });
+        if (stop_request_) {
+            break;
+        }
+        // nothing changed since the last tick, e.g. all sources are still connecting
+        if (!dirty_.exchange(false)) {
+            continue;
+        }
+
+        uint32_t ts = (uint32_t)((av_gettime_relative() - start_time_) / 1000);
+        std::string buf = BufferPool::GetInstance().acquire(size + MOSAIC_HEADER_SIZE);
+        uint8_t *data = (uint8_t *) &buf[0];
+        data[0] = (uint8_t)(width_ >> 8);
+        data[1] = (uint8_t)(width_);
+        data[2] = (uint8_t)(height_ >> 8);
+        data[3] = (uint8_t)(height_);
+        data[4] = (uint8_t)(ts >> 24);
+        data[5] = (uint8_t)(ts >> 16);
+        data[6] = (uint8_t)(ts >> 8);
+        data[7] = (uint8_t)(ts);
+        data[8] = FORMAT_NV12;
+        data[9] = 0;
+        data[10] = 0;
+        data[11] = 0;
+        {
+            std::unique_lock<std::shared_mutex> lk(canvas_mutex_);
+            memcpy(data + MOSAIC_HEADER_SIZE, canvas_.data(), size);
+        }
+
+        stop_lk.unlock();
+        if (ff_send_data_callback_ && user_data_) {
+            ff_send_data_callback_(user_data_, user_handle_, std::move(buf));
+        }
+        BufferPool::GetInstance().release(std::move(buf));
+        stop_lk.lock();
+
+        // a slow tick does not try to catch up with a burst of frames
+        auto now = std::chrono::steady_clock::now();
+        if (next < now) {
+            next = now;
+        }
+    }
+}
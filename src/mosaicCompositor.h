@@ -0,0 +1,88 @@
+#ifndef __MOSAIC_COMPOSITOR_H__
+#define __MOSAIC_COMPOSITOR_H__
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <shared_mutex>
+#include <condition_variable>
+#include "ffmpegWrapper.h"
+
+// Plays several sources into the cells of one shared NV12 canvas, and sends the canvas
+// as a single video frame per tick. One websocket session and one WebGL context then
+// show a whole split-screen layout.
+class MosaicCompositor {
+public:
+    using FfmpegWrapperPtr = std::shared_ptr<FfmpegWrapper>;
+
+    // position of a source on the canvas, in canvas pixels
+    struct Cell {
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    MosaicCompositor();
+
+    virtual ~MosaicCompositor();
+
+public:
+    // suggest be called before startPlay, NOT MUST.
+    int setCallback(void *user, uintptr_t handle,
+        const FF_RAW_DATA_CALLBACK &pfn, const FF_EXCEPTION_CALLBACK &pfn2);
+
+    // count sources on a near-square grid, e.g. 1/4/9/16/25
+    static void GridLayout(int count, int width, int height, std::vector<Cell> *cells);
+
+    // cells.size() must equal urls.size()
+    int startPlay(const std::vector<std::string> &urls, const std::vector<Cell> &cells,
+                  int width, int height, int fps, int useGPU = 1, int useTCP = 1);
+
+    int stopPlay();
+
+    // returns right away, see FfmpegWrapper::requestStop
+    void requestStop();
+
+    // discard one frame per two frames on every source, 0: close, 1: open
+    int openDiscardFrames(int enabled);
+
+private:
+    int write_cell(int index, AVFrame *frame, int width, int height);
+
+    void clear_rect(const Cell &rect);
+
+    void tick_thread();
+
+private:
+    int width_;
+    int height_;
+    int fps_;
+
+    // cells are written concurrently under a shared lock, they never overlap;
+    // the sender takes the exclusive lock to read a consistent canvas.
+    std::shared_mutex canvas_mutex_;
+    std::vector<uint8_t> canvas_;
+    std::vector<Cell> cells_;
+    // the part of each cell covered by the last picture, the rest is black
+    std::vector<Cell> drawn_;
+    std::atomic<bool> dirty_;
+
+    std::vector<FfmpegWrapperPtr> sources_;
+
+    std::thread tick_thread_handle_;
+    std::mutex stop_mutex_;
+    std::condition_variable stop_cond_;
+    bool stop_request_;
+    int64_t start_time_;
+
+    void *user_data_;
+    uintptr_t user_handle_;
+    FF_RAW_DATA_CALLBACK ff_send_data_callback_;
+    FF_EXCEPTION_CALLBACK ff_exception_callback_;
+};
+
+#endif // __MOSAIC_COMPOSITOR_H__
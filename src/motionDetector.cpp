@@ -0,0 +1,83 @@
+#include "motionDetector.h"
+
+extern "C" {
+#include <libavutil/pixdesc.h>
+#include <libavutil/common.h>
+}
+
+constexpr int MOTION_THUMB_WIDTH = 128;
+constexpr int MOTION_THUMB_HEIGHT = 64;
+constexpr int MOTION_CELL_BITS = 3;
+constexpr int MOTION_CELL_SIZE = 1 << MOTION_CELL_BITS;
+// mean absolute difference per pixel a cell needs to count as changed, above sensor noise
+constexpr int MOTION_NOISE_LEVEL = 6;
+// keep the full rate for a while after the last motion, so the end of an event is not cut
+constexpr int64_t MOTION_HOLD_US = 2 * 1000000LL;
+constexpr int MOTION_IDLE_FPS_DEFAULT = 1;
+
+MotionDetector::MotionDetector(int idle_fps, int threshold) :
+        idle_interval_us_(1000000 / (idle_fps > 0 ? idle_fps : MOTION_IDLE_FPS_DEFAULT)),
+        threshold_(FFMAX(threshold, 1)), last_motion_us_(0), last_output_us_(0),
+        thumb_(MOTION_THUMB_WIDTH * MOTION_THUMB_HEIGHT), prev_(MOTION_THUMB_WIDTH * MOTION_THUMB_HEIGHT),
+        has_prev_(false) {
+    sad_fn_ = av_pixelutils_get_sad_fn(MOTION_CELL_BITS, MOTION_CELL_BITS, 0, nullptr);
+}
+
+int MotionDetector::update(const AVFrame *frame) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+        desc->comp[0].depth != 8 || frame->width <= 0 || frame->height <= 0) {
+        return -1;
+    }
+
+    // point sampling, packed formats (e.g. YUYV) step over the chroma bytes
+    int step = desc->comp[0].step;
+    const uint8_t *luma = frame->data[desc->comp[0].plane] + desc->comp[0].offset;
+    for (int y = 0; y < MOTION_THUMB_HEIGHT; y++) {
+        const uint8_t *src = luma + (size_t)(y * frame->height / MOTION_THUMB_HEIGHT) * frame->linesize[0];
+        uint8_t *dst = thumb_.data() + y * MOTION_THUMB_WIDTH;
+        for (int x = 0; x < MOTION_THUMB_WIDTH; x++) {
+            dst[x] = src[(x * frame->width / MOTION_THUMB_WIDTH) * step];
+        }
+    }
+
+    int score = 100;
+    if (has_prev_) {
+        const int limit = MOTION_NOISE_LEVEL * MOTION_CELL_SIZE * MOTION_CELL_SIZE;
+        int cells = 0, changed = 0;
+        for (int y = 0; y < MOTION_THUMB_HEIGHT; y += MOTION_CELL_SIZE) {
+            for (int x = 0; x < MOTION_THUMB_WIDTH; x += MOTION_CELL_SIZE) {
+                const uint8_t *cur = thumb_.data() + y * MOTION_THUMB_WIDTH + x;
+                const uint8_t *ref = prev_.data() + y * MOTION_THUMB_WIDTH + x;
+                int sad = 0;
+                if (sad_fn_) {
+                    sad = sad_fn_(cur, MOTION_THUMB_WIDTH, ref, MOTION_THUMB_WIDTH);
+                } else {
+                    for (int i = 0; i < MOTION_CELL_SIZE; i++) {
+                        for (int j = 0; j < MOTION_CELL_SIZE; j++) {
+                            sad += FFABS(cur[i * MOTION_THUMB_WIDTH + j] - ref[i * MOTION_THUMB_WIDTH + j]);
+                        }
+                    }
+                }
+                changed += sad > limit ? 1 : 0;
+                cells++;
+            }
+        }
+        // a single changed cell gives score 1
+        score = (changed * 100 + cells - 1) / cells;
+    }
+    thumb_.swap(prev_);
+    has_prev_ = true;
+    return score;
+}
+
+bool MotionDetector::shouldOutput(int score, int64_t now_us) {
+    if (score < 0 || score >= threshold_) {
+        last_motion_us_ = now_us;
+    }
+    if (now_us - last_motion_us_ < MOTION_HOLD_US || now_us - last_output_us_ >= idle_interval_us_) {
+        last_output_us_ = now_us;
+        return true;
+    }
+    return false;
+}
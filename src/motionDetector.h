@@ -0,0 +1,44 @@
+#ifndef __MOTION_DETECTOR_H__
+#define __MOTION_DETECTOR_H__
+
+#include <vector>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixelutils.h>
+}
+
+// Cheap per frame activity score, used to lower the output rate of static scenes.
+// The luma plane of the decoded frame is point sampled into a small thumbnail, which is
+// compared cell by cell against the previous thumbnail with the pixelutils SAD kernels.
+// The score is the share of cells (0~100) whose mean difference is above the noise level.
+class MotionDetector {
+public:
+    // idle_fps: output rate while the scene is static, threshold: score from which a
+    // frame counts as motion
+    MotionDetector(int idle_fps, int threshold);
+
+    virtual ~MotionDetector() = default;
+
+    // returns the score of frame against the previous frame, -1 if the pixel format has
+    // no 8 bit luma plane (the frame then always counts as motion)
+    int update(const AVFrame *frame);
+
+    // whether a frame with score taken at now_us (monotonic) should be sent. every frame
+    // is sent during motion and for a while after it, then idle_fps frames per second.
+    bool shouldOutput(int score, int64_t now_us);
+
+private:
+    int idle_interval_us_;
+    int threshold_;
+    int64_t last_motion_us_;
+    int64_t last_output_us_;
+
+    std::vector<uint8_t> thumb_;
+    std::vector<uint8_t> prev_;
+    bool has_prev_;
+    av_pixelutils_sad_fn sad_fn_;
+};
+
+#endif // __MOTION_DETECTOR_H__
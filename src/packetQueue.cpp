@@ -4,7 +4,9 @@
 PacketQueue::PacketQueue() {
     pkt_list_ = av_fifo_alloc(sizeof(MyAVPacketList));
     stop_request_ = 0;
+    serial_ = 0;
     nb_packets_ = 0;
+    bytes_ = 0;
 }
 
 PacketQueue::~PacketQueue() {
@@ -25,18 +27,22 @@ int PacketQueue::put(AVPacket *pkt) {
     av_packet_move_ref(pkt1, pkt);
 
     std::lock_guard<std::mutex> lck(mutex_);
+    int size = pkt1->size;
     ret = put_private(pkt1);
     cond_.notify_all();
 
-    if (ret < 0)
+    if (ret < 0) {
         av_packet_free(&pkt1);
+        return ret;
+    }
 
     nb_packets_++;
+    bytes_ += size;
 
     return ret;
 }
 
-int PacketQueue::get(AVPacket *pkt) {
+int PacketQueue::get(AVPacket *pkt, int *serial) {
     MyAVPacketList pkt1;
 
     std::unique_lock<std::mutex> lck(mutex_);
@@ -49,8 +55,12 @@ int PacketQueue::get(AVPacket *pkt) {
     av_fifo_generic_read(pkt_list_, &pkt1, sizeof(pkt1), NULL);
     av_packet_move_ref(pkt, pkt1.pkt);
     av_packet_free(&pkt1.pkt);
+    if (serial) {
+        *serial = pkt1.serial;
+    }
 
     nb_packets_--;
+    bytes_ -= pkt->size;
 
     return 0;
 }
@@ -63,6 +73,38 @@ void PacketQueue::flush() {
         av_fifo_generic_read(pkt_list_, &pkt1, sizeof(pkt1), NULL);
         av_packet_free(&pkt1.pkt);
     }
+    nb_packets_ = 0;
+    bytes_ = 0;
+}
+
+int PacketQueue::dropToKeyframe(bool *found) {
+    MyAVPacketList pkt1;
+
+    std::lock_guard<std::mutex> lck(mutex_);
+    int count = av_fifo_size(pkt_list_) / sizeof(pkt1);
+    int keep = -1;
+    for (int i = count - 1; i >= 0; i--) {
+        av_fifo_generic_peek_at(pkt_list_, &pkt1, i * sizeof(pkt1), sizeof(pkt1), NULL);
+        if (pkt1.pkt->flags & AV_PKT_FLAG_KEY) {
+            keep = i;
+            break;
+        }
+    }
+    *found = keep >= 0;
+
+    int dropped = keep >= 0 ? keep : count;
+    for (int i = 0; i < dropped; i++) {
+        av_fifo_generic_read(pkt_list_, &pkt1, sizeof(pkt1), NULL);
+        nb_packets_--;
+        bytes_ -= pkt1.pkt->size;
+        av_packet_free(&pkt1.pkt);
+    }
+    return dropped;
+}
+
+void PacketQueue::setSerial(int serial) {
+    std::lock_guard<std::mutex> lck(mutex_);
+    serial_ = serial;
 }
 
 void PacketQueue::stop() {
@@ -75,6 +117,11 @@ int PacketQueue::size() const
     return nb_packets_;
 }
 
+int64_t PacketQueue::bytes() const
+{
+    return bytes_;
+}
+
 int PacketQueue::put_private(AVPacket *pkt) {
     MyAVPacketList pkt1;
     if (av_fifo_space(pkt_list_) < sizeof(pkt1)) {
@@ -83,6 +130,7 @@ int PacketQueue::put_private(AVPacket *pkt) {
     }
 
     pkt1.pkt = pkt;
+    pkt1.serial = serial_;
     av_fifo_generic_write(pkt_list_, &pkt1, sizeof(pkt1), NULL);
     return 0;
 }
@@ -2,6 +2,7 @@
 #define __PACKET_QUEUE_H__
 
 #include <mutex>
+#include <atomic>
 #include <thread>
 #include <condition_variable>
 
@@ -23,7 +24,11 @@ public:
 
     int put(AVPacket *pkt);
 
-    int get(AVPacket *pkt);
+    // serial: of the input the packet was read from, see setSerial
+    int get(AVPacket *pkt, int *serial = nullptr);
+
+    // packets put from now on carry serial, e.g. after the input was switched
+    void setSerial(int serial);
 
     void flush();
 
@@ -31,6 +36,13 @@ public:
 
     int size() const;
 
+    // bytes of packet data queued
+    int64_t bytes() const;
+
+    // drops the packets in front of the last keyframe queued, so decoding goes on from it.
+    // without a keyframe everything is dropped and found is false. returns the number dropped.
+    int dropToKeyframe(bool *found);
+
 private:
     int put_private(AVPacket *pkt);
 
@@ -39,7 +51,9 @@ private:
     std::mutex mutex_;
     std::condition_variable cond_;
     int stop_request_;
+    int serial_;
     int nb_packets_;
+    std::atomic<int64_t> bytes_;
 };
 
 #endif // __PACKET_QUEUE_H__
@@ -0,0 +1,103 @@
+#ifndef __PIXEL_KERNELS_H__
+#define __PIXEL_KERNELS_H__
+
+#include <cstring>
+#include <cstdint>
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+
+// Same-size conversions between the 8-bit 4:2:0 layouts decoders produce and the output
+// formats. Each source/destination pair is its own kernel working on whole rows, so the
+// inner loops carry no per-pixel format checks. Pairs without a kernel go through swscale.
+namespace PixelKernels {
+
+// plane 0 of every 8-bit YUV layout is the luma plane
+inline void CopyLuma(const AVFrame *in, uint8_t *const dst_data[4], const int dst_linesize[4], int width, int height) {
+    for (int y = 0; y < height; y++) {
+        memcpy(dst_data[0] + (size_t)y * dst_linesize[0], in->data[0] + (size_t)y * in->linesize[0], width);
+    }
+}
+
+template <enum AVPixelFormat Src, enum AVPixelFormat Dst>
+struct Convert;
+
+template <enum AVPixelFormat Src>
+struct Convert<Src, AV_PIX_FMT_GRAY8> {
+    static void run(const AVFrame *in, uint8_t *const dst_data[4], const int dst_linesize[4], int width, int height) {
+        CopyLuma(in, dst_data, dst_linesize, width, height);
+    }
+};
+
+template <>
+struct Convert<AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12> {
+    static void run(const AVFrame *in, uint8_t *const dst_data[4], const int dst_linesize[4], int width, int height) {
+        CopyLuma(in, dst_data, dst_linesize, width, height);
+        int chroma_width = (width + 1) / 2;
+        for (int y = 0; y < (height + 1) / 2; y++) {
+            const uint8_t *u = in->data[1] + (size_t)y * in->linesize[1];
+            const uint8_t *v = in->data[2] + (size_t)y * in->linesize[2];
+            uint8_t *uv = dst_data[1] + (size_t)y * dst_linesize[1];
+            for (int x = 0; x < chroma_width; x++) {
+                uv[2 * x] = u[x];
+                uv[2 * x + 1] = v[x];
+            }
+        }
+    }
+};
+
+template <>
+struct Convert<AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P> {
+    static void run(const AVFrame *in, uint8_t *const dst_data[4], const int dst_linesize[4], int width, int height) {
+        CopyLuma(in, dst_data, dst_linesize, width, height);
+        int chroma_width = (width + 1) / 2;
+        for (int y = 0; y < (height + 1) / 2; y++) {
+            const uint8_t *uv = in->data[1] + (size_t)y * in->linesize[1];
+            uint8_t *u = dst_data[1] + (size_t)y * dst_linesize[1];
+            uint8_t *v = dst_data[2] + (size_t)y * dst_linesize[2];
+            for (int x = 0; x < chroma_width; x++) {
+                u[x] = uv[2 * x];
+                v[x] = uv[2 * x + 1];
+            }
+        }
+    }
+};
+
+// picks the kernel for a pair of different formats, false if there is none (swscale then).
+// frames of the output format are copied by the caller.
+inline bool ConvertSameSize(const AVFrame *in, enum AVPixelFormat dst_format,
+                            uint8_t *const dst_data[4], const int dst_linesize[4]) {
+    int width = in->width;
+    int height = in->height;
+    // full range YUVJ420P is left to swscale, which converts it to the limited range clients expect
+    switch (in->format) {
+    case AV_PIX_FMT_YUV420P:
+        if (dst_format == AV_PIX_FMT_NV12) {
+            Convert<AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12>::run(in, dst_data, dst_linesize, width, height);
+            return true;
+        }
+        if (dst_format == AV_PIX_FMT_GRAY8) {
+            Convert<AV_PIX_FMT_YUV420P, AV_PIX_FMT_GRAY8>::run(in, dst_data, dst_linesize, width, height);
+            return true;
+        }
+        return false;
+    case AV_PIX_FMT_NV12:
+        if (dst_format == AV_PIX_FMT_YUV420P) {
+            Convert<AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P>::run(in, dst_data, dst_linesize, width, height);
+            return true;
+        }
+        if (dst_format == AV_PIX_FMT_GRAY8) {
+            Convert<AV_PIX_FMT_NV12, AV_PIX_FMT_GRAY8>::run(in, dst_data, dst_linesize, width, height);
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+} // namespace PixelKernels
+
+#endif // __PIXEL_KERNELS_H__
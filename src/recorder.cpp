@@ -0,0 +1,280 @@
+#include "recorder.h"
+#include <cmath>
+#include <cstdio>
+#include <sstream>
+#include <filesystem>
+#include "log.h"
+
+constexpr int RECORD_SEGMENT_SECONDS_DEFAULT = 4;
+constexpr int RECORD_SEGMENTS_DEFAULT = 150;
+constexpr int RECORD_TIME_SCALE = 90000;
+// the first dts, leaves room for pts ahead of it like FFmpeg's muxers do
+constexpr int64_t RECORD_TS_OFFSET = 126000;
+constexpr size_t RECORD_WRITE_SIZE = 1024 * 1024;
+// data queued for a slow disk beyond this is dropped instead of growing without bound
+constexpr size_t RECORD_QUEUE_MAX = 64 * 1024 * 1024;
+
+Recorder::Recorder(uintptr_t handle, const std::string &dir, int segment_seconds, int max_segments) :
+        handle_(handle), dir_(dir),
+        segment_seconds_(segment_seconds > 0 ? segment_seconds : RECORD_SEGMENT_SECONDS_DEFAULT),
+        max_segments_(max_segments > 0 ? max_segments : RECORD_SEGMENTS_DEFAULT),
+        opened_(false), failed_(false), bsf_(nullptr), bsf_pkt_(nullptr), time_base_({ 1, RECORD_TIME_SCALE }),
+        first_dts_(AV_NOPTS_VALUE), last_dts_(0), sequence_(0), segment_start_(0), segment_open_(false),
+        segment_bytes_(0),
+        pending_bytes_(0), io_stop_(false), file_(nullptr) {
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    if (ec) {
+        LOG_ERROR << "[" << handle_ << "]Could not create record directory " << dir_ << ": " << ec.message();
+        failed_ = true;
+    }
+    io_thread_ = std::thread(&Recorder::io_thread, this);
+}
+
+Recorder::~Recorder() {
+    stop();
+    av_bsf_free(&bsf_);
+    av_packet_free(&bsf_pkt_);
+}
+
+int Recorder::open(const AVCodecParameters *par, AVRational time_base) {
+    if (!TsWriter::Supports(par->codec_id)) {
+        LOG_ERROR << "[" << handle_ << "]Could not record " << avcodec_get_name(par->codec_id);
+        return AVERROR(ENOSYS);
+    }
+    const char *filters = TsWriter::AnnexBFilters(par);
+    int ret;
+    if ((ret = av_bsf_list_parse_str(filters, &bsf_)) < 0 ||
+        (ret = avcodec_parameters_copy(bsf_->par_in, par)) < 0) {
+        return ret;
+    }
+    bsf_->time_base_in = time_base;
+    if ((ret = av_bsf_init(bsf_)) < 0) {
+        return ret;
+    }
+    if (!(bsf_pkt_ = av_packet_alloc())) {
+        return AVERROR(ENOMEM);
+    }
+    time_base_ = time_base;
+    ts_.reset(new TsWriter(par->codec_id));
+    LOG_INFO << "[" << handle_ << "]record " << avcodec_get_name(par->codec_id) << " to " << dir_;
+    return 0;
+}
+
+int Recorder::write(const AVCodecParameters *par, AVRational time_base, const AVPacket *pkt) {
+    if (failed_) {
+        return -1;
+    }
+    if (!opened_) {
+        if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+            return 0;
+        }
+        if (open(par, time_base) < 0) {
+            failed_ = true;
+            return -1;
+        }
+        opened_ = true;
+    }
+
+    int ret = av_packet_ref(bsf_pkt_, pkt);
+    if (ret >= 0) {
+        ret = av_bsf_send_packet(bsf_, bsf_pkt_);
+    }
+    while (ret >= 0) {
+        ret = av_bsf_receive_packet(bsf_, bsf_pkt_);
+        if (ret < 0) {
+            break;
+        }
+        write_packet(bsf_pkt_);
+        av_packet_unref(bsf_pkt_);
+    }
+    av_packet_unref(bsf_pkt_);
+    return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+void Recorder::write_packet(const AVPacket *pkt) {
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : dts;
+    int64_t dts90, pts90;
+    if (dts == AV_NOPTS_VALUE) {
+        dts90 = pts90 = last_dts_ + 1;
+    } else {
+        if (first_dts_ == AV_NOPTS_VALUE) {
+            first_dts_ = dts;
+        }
+        dts90 = av_rescale_q(dts - first_dts_, time_base_, { 1, RECORD_TIME_SCALE }) + RECORD_TS_OFFSET;
+        pts90 = av_rescale_q(pts - first_dts_, time_base_, { 1, RECORD_TIME_SCALE }) + RECORD_TS_OFFSET;
+    }
+    // players need strictly increasing dts
+    if (segment_open_ && dts90 <= last_dts_) {
+        dts90 = last_dts_ + 1;
+    }
+    pts90 = FFMAX(pts90, dts90);
+
+    bool key = pkt->flags & AV_PKT_FLAG_KEY;
+    if (key && (!segment_open_ || dts90 - segment_start_ >= (int64_t)segment_seconds_ * RECORD_TIME_SCALE)) {
+        if (segment_open_) {
+            last_dts_ = dts90;
+            finish_segment(false);
+        }
+        segment_start_ = dts90;
+        start_segment();
+    }
+    last_dts_ = dts90;
+    if (!segment_open_) {
+        return;
+    }
+
+    index_.add(pts90, segment_bytes_ + (int64_t)buffer_.size(), key);
+    ts_->writeFrame(pkt->data, pkt->size, pts90, dts90, key, &buffer_);
+    if (buffer_.size() >= RECORD_WRITE_SIZE) {
+        flush_buffer();
+    }
+}
+
+void Recorder::start_segment() {
+    std::string path = dir_ + "/seg_" + std::to_string(sequence_) + ".ts";
+    post([this, path]() {
+        if (file_) {
+            fclose(file_);
+        }
+        if (!(file_ = fopen(path.c_str(), "wb"))) {
+            LOG_ERROR << "[" << handle_ << "]Could not open " << path;
+        }
+    }, 0);
+    buffer_.clear();
+    segment_bytes_ = 0;
+    index_ = KeyframeIndex::Builder();
+    ts_->writeTables(&buffer_);
+    segment_open_ = true;
+}
+
+// last_dts_ is the end of the segment, i.e. the start of the next one. the keyframe index of
+// the segment is written once the file is complete.
+void Recorder::finish_segment(bool ended) {
+    flush_buffer();
+    std::string path = dir_ + "/seg_" + std::to_string(sequence_) + ".ts";
+    auto entries = std::make_shared<std::vector<KeyframeIndex::Entry>>(index_.finish(segment_bytes_));
+    post([this, path, entries]() {
+        if (file_) {
+            fclose(file_);
+            file_ = nullptr;
+            KeyframeIndex::Save(path, { 1, RECORD_TIME_SCALE }, *entries);
+        }
+    }, 0);
+    segments_.push_back({ sequence_++, (double)(last_dts_ - segment_start_) / RECORD_TIME_SCALE });
+    segment_open_ = false;
+
+    while ((int)segments_.size() > max_segments_) {
+        std::string path = dir_ + "/seg_" + std::to_string(segments_.front().sequence) + ".ts";
+        segments_.pop_front();
+        post([path]() {
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            std::filesystem::remove(KeyframeIndex::SidecarPath(path), ec);
+        }, 0);
+    }
+    write_playlist("index.m3u8", ended);
+    write_playlist("replay.m3u8", true);
+}
+
+void Recorder::write_playlist(const std::string &name, bool ended) {
+    double target = segment_seconds_;
+    for (const Segment &segment : segments_) {
+        target = FFMAX(target, segment.duration);
+    }
+
+    std::ostringstream os;
+    os << "#EXTM3U\n#EXT-X-VERSION:3\n"
+       << "#EXT-X-TARGETDURATION:" << (int)std::ceil(target) << "\n"
+       << "#EXT-X-MEDIA-SEQUENCE:" << (segments_.empty() ? 0 : segments_.front().sequence) << "\n";
+    char extinf[64];
+    for (const Segment &segment : segments_) {
+        snprintf(extinf, sizeof(extinf), "#EXTINF:%.3f,\n", segment.duration);
+        os << extinf << "seg_" << segment.sequence << ".ts\n";
+    }
+    if (ended) {
+        os << "#EXT-X-ENDLIST\n";
+    }
+
+    // readers never see a half written playlist
+    std::string path = dir_ + "/" + name;
+    std::string text = os.str();
+    post([path, text]() {
+        std::string tmp = path + ".tmp";
+        FILE *fp = fopen(tmp.c_str(), "wb");
+        if (!fp) {
+            return;
+        }
+        fwrite(text.data(), 1, text.size(), fp);
+        fclose(fp);
+        std::error_code ec;
+        std::filesystem::rename(tmp, path, ec);
+    }, 0);
+}
+
+void Recorder::flush_buffer() {
+    if (buffer_.empty()) {
+        return;
+    }
+    auto chunk = std::make_shared<std::string>();
+    chunk->swap(buffer_);
+    segment_bytes_ += (int64_t)chunk->size();
+    size_t size = chunk->size();
+    post([this, chunk]() {
+        if (file_ && fwrite(chunk->data(), 1, chunk->size(), file_) != chunk->size()) {
+            LOG_ERROR << "[" << handle_ << "]Could not write record data";
+        }
+    }, size);
+}
+
+void Recorder::post(std::function<void()> job, size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lk(io_mutex_);
+        if (bytes > 0 && pending_bytes_ + bytes > RECORD_QUEUE_MAX) {
+            LOG_WARN << "[" << handle_ << "]disk too slow, " << bytes << " bytes of record data dropped";
+            return;
+        }
+        pending_bytes_ += bytes;
+        jobs_.emplace_back([this, job, bytes]() {
+            job();
+            std::lock_guard<std::mutex> lk(io_mutex_);
+            pending_bytes_ -= bytes;
+        });
+    }
+    io_cond_.notify_one();
+}
+
+void Recorder::stop() {
+    if (segment_open_) {
+        finish_segment(true);
+    }
+    {
+        std::lock_guard<std::mutex> lk(io_mutex_);
+        io_stop_ = true;
+    }
+    io_cond_.notify_one();
+    if (io_thread_.joinable()) {
+        io_thread_.join();
+    }
+}
+
+void Recorder::io_thread() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lk(io_mutex_);
+            io_cond_.wait(lk, [this]() { return io_stop_ || !jobs_.empty(); });
+            if (jobs_.empty()) {
+                break;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        job();
+    }
+    if (file_) {
+        fclose(file_);
+        file_ = nullptr;
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+#include "tsWriter.h"
+#include "keyframeIndex.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+}
+
+// Records the video packets a session reads, without decoding, into a ring of MPEG-TS
+// segments with an HLS playlist, so that the ring can be played back through the normal
+// play request (hls demuxer) with pause and seek:
+//   <dir>/index.m3u8    the ring, a live playlist while recording
+//   <dir>/replay.m3u8   the finished segments as a seekable playlist
+// Packets are converted to Annex-B on the read thread, file I/O runs on a thread of its own
+// with large writes. Every finished segment gets a keyframe index sidecar (seg_N.ts.kfi).
+class Recorder {
+public:
+    Recorder(uintptr_t handle, const std::string &dir, int segment_seconds, int max_segments);
+
+    virtual ~Recorder();
+
+    // called on the read thread for every video packet, recording starts at the first keyframe
+    int write(const AVCodecParameters *par, AVRational time_base, const AVPacket *pkt);
+
+    // closes the last segment, the playlists are complete when this returns
+    void stop();
+
+    const std::string &dir() const { return dir_; }
+
+private:
+    int open(const AVCodecParameters *par, AVRational time_base);
+
+    void write_packet(const AVPacket *pkt);
+
+    void start_segment();
+
+    void finish_segment(bool ended);
+
+    void write_playlist(const std::string &name, bool ended);
+
+    void flush_buffer();
+
+    void post(std::function<void()> job, size_t bytes);
+
+    void io_thread();
+
+private:
+    struct Segment {
+        int64_t sequence;
+        double duration;
+    };
+
+    uintptr_t handle_;
+    std::string dir_;
+    int segment_seconds_;
+    int max_segments_;
+
+    bool opened_;
+    bool failed_;
+    AVBSFContext *bsf_;
+    AVPacket *bsf_pkt_;
+    std::unique_ptr<TsWriter> ts_;
+    AVRational time_base_;
+    int64_t first_dts_;
+    int64_t last_dts_;
+
+    std::deque<Segment> segments_;
+    int64_t sequence_;
+    int64_t segment_start_;     // 90 kHz
+    bool segment_open_;
+    int64_t segment_bytes_;     // of the current segment, flushed to the io thread so far
+    KeyframeIndex::Builder index_;
+    std::string buffer_;
+
+    std::mutex io_mutex_;
+    std::condition_variable io_cond_;
+    std::deque<std::function<void()>> jobs_;
+    size_t pending_bytes_;
+    bool io_stop_;
+    std::thread io_thread_;
+    FILE *file_;                // io thread only
+};
+
+#endif // __RECORDER_H__
@@ -0,0 +1,58 @@
+#include "sessionReaper.h"
+#include "log.h"
+
+// a teardown stuck on a dead input does not hold up the others
+constexpr int REAPER_THREADS = 2;
+
+SessionReaper &SessionReaper::GetInstance() {
+    static SessionReaper instance(REAPER_THREADS);
+    return instance;
+}
+
+SessionReaper::SessionReaper(int threads) : stop_request_(false) {
+    for (int i = 0; i < threads; i++) {
+        workers_.emplace_back(&SessionReaper::worker, this);
+    }
+}
+
+SessionReaper::~SessionReaper() {
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stop_request_ = true;
+    }
+    cond_.notify_all();
+    for (auto &t: workers_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
+
+void SessionReaper::reap(std::function<void()> teardown) {
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        jobs_.emplace_back(std::move(teardown));
+    }
+    cond_.notify_one();
+}
+
+void SessionReaper::worker() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            cond_.wait(lk, [this]() { return stop_request_ || !jobs_.empty(); });
+            if (jobs_.empty()) {
+                break;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        try {
+            job();
+        }
+        catch (const std::exception &e) {
+            LOG_ERROR << "session teardown exception(" << e.what() << ")";
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __SESSION_REAPER_H__
+#define __SESSION_REAPER_H__
+
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+// Tears sessions down off the WebSocket I/O thread. Stopping a session joins its threads and
+// releases decoders and devices, which may take a while; the I/O thread only hands it over
+// and goes on serving the other connections. Threads of its own, not the ThreadPool, since
+// teardowns block.
+class SessionReaper {
+public:
+    static SessionReaper &GetInstance();
+
+    // pending teardowns are finished before this returns
+    virtual ~SessionReaper();
+
+    void reap(std::function<void()> teardown);
+
+private:
+    explicit SessionReaper(int threads);
+
+    void worker();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> jobs_;
+    std::vector<std::thread> workers_;
+    bool stop_request_;
+};
+
+#endif // __SESSION_REAPER_H__
@@ -1,8 +1,41 @@
 ﻿#include "signalSession.h"
 #include "version.h"
+#include "config.h"
+#include "sessionReaper.h"
+#include "standbyPool.h"
+#include <ctime>
 #include <memory>
 
+extern "C" {
+#include <libavutil/base64.h>
+}
+
 const int YUV444_4K = 3840 * 2160 * 3;
+const int MOSAIC_WIDTH_DEFAULT = 1920;
+const int MOSAIC_HEIGHT_DEFAULT = 1080;
+const int MOSAIC_MIN_SIZE = 16;
+// the canvas is sent as one message, see YUV444_4K
+const int MOSAIC_MAX_WIDTH = 3840;
+const int MOSAIC_MAX_HEIGHT = 2160;
+
+static int sendVideoData(void *user, uintptr_t handle, std::string &&data) {
+    if (data.size() > YUV444_4K) {
+        LOG_ERROR << " Msg too large to send(size=" << data.size() << ")";
+        return -1;
+    }
+    WebsocketServer *ws = static_cast<WebsocketServer *>(user);
+    return ws->Send(handle, std::move(data));
+}
+
+static int sendException(void *user, uintptr_t handle, int err_code, const uint8_t *err_desc) {
+    Json::Value responseBody;
+    responseBody["result"] = err_code;
+    responseBody["message"] = (const char *) err_desc;
+    WebsocketServer *ws = static_cast<WebsocketServer *>(user);
+    return ws->Send(handle, (uint8_t *) responseBody.toStyledString().c_str(),
+                    responseBody.toStyledString().size(),
+                    WebsocketServer::OpCode::text);
+}
 
 int SignalSession::MessageFunc(WebsocketServer *ws, uintptr_t hdl, const std::string &msg) {
     LOG_DEBUG << "msg:" << msg;
@@ -24,7 +57,12 @@ void SignalSession::CloseFunc(WebsocketServer *ws, uintptr_t hdl) {
 }
 
 void SignalSession::stopFFmpeg(WebsocketServer *ws, uintptr_t hdl) {
+    releaseResource(hdl);
+}
+
+void SignalSession::releaseResource(uintptr_t hdl) {
     FfmpegWrapperPtr ffPtr;
+    MosaicCompositorPtr mosaicPtr;
     {
         std::lock_guard<std::mutex> lk(mu_);
         auto iter = mediaResourceManager_.find(hdl);
@@ -32,11 +70,27 @@ void SignalSession::stopFFmpeg(WebsocketServer *ws, uintptr_t hdl) {
             return;
         }
         ffPtr = iter->second.ffmpegWrapper;
+        mosaicPtr = iter->second.compositor;
         mediaResourceManager_.erase(iter);
     }
+    // called on the WebSocket I/O thread: the session goes quiet at once, joining its threads
+    // and freeing it is left to the reaper so other connections are not held up
     if (ffPtr) {
-        ffPtr->stopPlay();
+        ffPtr->requestStop();
+    }
+    if (mosaicPtr) {
+        mosaicPtr->requestStop();
     }
+    SessionReaper::GetInstance().reap([ffPtr, mosaicPtr]() mutable {
+        if (ffPtr) {
+            ffPtr->stopPlay();
+        }
+        if (mosaicPtr) {
+            mosaicPtr->stopPlay();
+        }
+        ffPtr.reset();
+        mosaicPtr.reset();
+    });
 }
 
 int
@@ -80,6 +134,45 @@ SignalSession::parseAndProcess(WebsocketServer *ws, uintptr_t hdl, const std::st
         case API_GetVersion: 
             responseBody["version"] = getVersion();
             break;
+        case API_SetCrop:
+            code = setCropRegion(hdl, jsonRequest);
+            break;
+        case API_PlayMosaic:
+            code = playMosaic(ws, hdl, jsonRequest);
+            break;
+        case API_Resync:
+            code = resync(hdl);
+            break;
+        case API_Snapshot:
+            code = snapshot(hdl, jsonRequest, responseBody);
+            break;
+        case API_StartRecord:
+            code = startRecord(hdl, jsonRequest, responseBody);
+            break;
+        case API_StopRecord:
+            code = stopRecord(hdl);
+            break;
+        case API_Pause:
+            code = pause(hdl, 1);
+            break;
+        case API_Resume:
+            code = pause(hdl, 0);
+            break;
+        case API_Seek:
+            code = seek(hdl, jsonRequest);
+            break;
+        case API_Scrub:
+            code = scrub(hdl, jsonRequest);
+            break;
+        case API_SetRate:
+            code = setRate(hdl, jsonRequest);
+            break;
+        case API_Switch:
+            code = switchInput(hdl, jsonRequest);
+            break;
+        case API_Preload:
+            code = preload(jsonRequest);
+            break;
         default:
             code = NotSupport;
     }
@@ -92,6 +185,15 @@ SignalSession::parseAndProcess(WebsocketServer *ws, uintptr_t hdl, const std::st
 int SignalSession::playVideo(WebsocketServer *ws, uintptr_t hdl, const Json::Value &jsonRequest) {
     uint16_t width, height, useGPU = 0;
     uint16_t useTCP = 1;
+    int fitMode = FIT_Stretch;
+    int outputMode = OUTPUT_Raw;
+    int outputFormat = -1;
+    int compress = 0;
+    int deltaBlock = 0, deltaThreshold = 0, deltaInterval = 0;
+    int motion = 0, idleFps = 0, motionThreshold = 0;
+    int snapshotInterval = 0;
+    int bitrate = 0, gop = 0;
+    std::string preset;
     std::string url;
 
     try {
@@ -109,31 +211,52 @@ int SignalSession::playVideo(WebsocketServer *ws, uintptr_t hdl, const Json::Val
         if (playParam.isMember("use_tcp")) {
             useTCP = playParam["use_tcp"].asUInt();
         }
+        if (playParam.isMember("fit")) {
+            fitMode = playParam["fit"].asInt();
+        }
+        if (playParam.isMember("mode")) {
+            outputMode = playParam["mode"].asInt();
+        }
+        if (playParam.isMember("format")) {
+            outputFormat = playParam["format"].asInt();
+        }
+        compress = playParam.get("compress", 0).asInt();
+        deltaBlock = playParam.get("delta", 0).asInt();
+        deltaThreshold = playParam.get("delta_threshold", 0).asInt();
+        deltaInterval = playParam.get("delta_interval", 0).asInt();
+        motion = playParam.get("motion", 0).asInt();
+        idleFps = playParam.get("idle_fps", 0).asInt();
+        motionThreshold = playParam.get("motion_threshold", 0).asInt();
+        snapshotInterval = playParam.get("snapshot_interval", 0).asInt();
+        bitrate = playParam.get("bitrate", 0).asInt();
+        gop = playParam.get("gop", 0).asInt();
+        preset = playParam.get("preset", "").asString();
     } catch (Json::Exception &e) {
         LOG_ERROR << "Parse Json Error:" << e.what();
         return InvalidJson;
     }
 
     FfmpegWrapperPtr ffPtr = std::make_shared<FfmpegWrapper>();
-    ffPtr->setCallback((void *) ws, hdl, 
-        [](void *user, uintptr_t handle, uint8_t *data, size_t length) -> int {
-            if (length > YUV444_4K) {
-                LOG_ERROR << " Msg too large to send(size=" << length << ")";
-                return -1;
-            }
-            WebsocketServer *ws = static_cast<WebsocketServer *>(user);
-            return ws->Send(handle, data, length);}, 
-        [](void* user, uintptr_t handle, int err_code, const uint8_t* err_desc) -> int {
-            Json::Value responseBody;
-            responseBody["result"] = err_code;
-            responseBody["message"] = (const char*)err_desc;
-            WebsocketServer* ws = static_cast<WebsocketServer*>(user);
-            return ws->Send(handle, (uint8_t*)responseBody.toStyledString().c_str(),
-                responseBody.toStyledString().size(),
-                WebsocketServer::OpCode::text);
-    });
+    ffPtr->setCallback((void *) ws, hdl, sendVideoData, sendException);
+
+    if (ffPtr->setFitMode(fitMode) != 0 || ffPtr->setTranscodeOptions(bitrate, gop, preset) != 0) {
+        return InvalidParameter;
+    }
+    if (outputFormat >= 0 && ffPtr->setOutputFormat(outputFormat) != 0) {
+        return InvalidParameter;
+    }
+    ffPtr->setCompression(compress);
+    if (ffPtr->setDelta(deltaBlock, deltaThreshold, deltaInterval) != 0 ||
+        ffPtr->setMotionAdaptive(motion, idleFps, motionThreshold) != 0 ||
+        ffPtr->setSnapshotInterval(snapshotInterval) != 0) {
+        return InvalidParameter;
+    }
 
     int ret = UnknownError;
+    if ((ret = ffPtr->setOutputMode(outputMode)) != NoneError) {
+        return ret;
+    }
+
     if ((ret = ffPtr->startPlay(url.c_str(), width, height, useGPU, useTCP)) != NoneError) {
         return ret;
     }
@@ -145,9 +268,85 @@ int SignalSession::playVideo(WebsocketServer *ws, uintptr_t hdl, const Json::Val
     return NoneError;
 }
 
+int SignalSession::playMosaic(WebsocketServer *ws, uintptr_t hdl, const Json::Value &jsonRequest) {
+    uint16_t useGPU = 0;
+    uint16_t useTCP = 1;
+    int width = MOSAIC_WIDTH_DEFAULT;
+    int height = MOSAIC_HEIGHT_DEFAULT;
+    int fps = 0;
+    std::vector<std::string> urls;
+    std::vector<MosaicCompositor::Cell> cells;
+    std::string description;
+
+    try {
+        if (!jsonRequest.isMember("param")) {
+            return NotSupport;
+        }
+        Json::Value playParam = jsonRequest["param"];
+        for (const auto &url : playParam["urls"]) {
+            urls.push_back(url.asString());
+            if (urls.back().empty()) {
+                return InvalidUrl;
+            }
+            description += (description.empty() ? "" : ";") + urls.back();
+        }
+        if (urls.empty()) {
+            return InvalidUrl;
+        }
+        useGPU = playParam["use_gpu"].asUInt();
+        if (playParam.isMember("use_tcp")) {
+            useTCP = playParam["use_tcp"].asUInt();
+        }
+        width = playParam.get("width", width).asInt();
+        height = playParam.get("height", height).asInt();
+        fps = playParam.get("fps", 0).asInt();
+        if (width < MOSAIC_MIN_SIZE || height < MOSAIC_MIN_SIZE ||
+            width > MOSAIC_MAX_WIDTH || height > MOSAIC_MAX_HEIGHT) {
+            return InvalidResolution;
+        }
+
+        // custom layout: one cell per url, in fractions of the canvas
+        if (playParam.isMember("cells")) {
+            const Json::Value &cellParam = playParam["cells"];
+            if (cellParam.size() != urls.size()) {
+                return InvalidParameter;
+            }
+            for (const auto &cell : cellParam) {
+                cells.push_back({ (int)(cell["x"].asDouble() * width), (int)(cell["y"].asDouble() * height),
+                                  (int)(cell["width"].asDouble() * width), (int)(cell["height"].asDouble() * height) });
+            }
+        } else {
+            int layout = playParam.get("layout", (int)urls.size()).asInt();
+            if (layout < (int)urls.size()) {
+                return InvalidParameter;
+            }
+            MosaicCompositor::GridLayout(layout, width, height, &cells);
+            cells.resize(urls.size());
+        }
+    } catch (Json::Exception &e) {
+        LOG_ERROR << "Parse Json Error:" << e.what();
+        return InvalidJson;
+    }
+
+    MosaicCompositorPtr mosaicPtr = std::make_shared<MosaicCompositor>();
+    mosaicPtr->setCallback((void *) ws, hdl, sendVideoData, sendException);
+
+    int ret = UnknownError;
+    if ((ret = mosaicPtr->startPlay(urls, cells, width, height, fps, useGPU, useTCP)) != NoneError) {
+        return ret;
+    }
+
+    mu_.lock();
+    mediaResourceManager_.insert(std::make_pair(hdl, MediaResource(std::move(description), mosaicPtr)));
+    mu_.unlock();
+
+    return NoneError;
+}
+
 int SignalSession::changeVideoResolution(uintptr_t hdl, const Json::Value &jsonRequest) {
     uint16_t width = -1;
     uint16_t height = -1;
+    int fitMode = -1;
     try {
         if (!jsonRequest.isMember("param")) {
             return NotSupport;
@@ -155,6 +354,9 @@ int SignalSession::changeVideoResolution(uintptr_t hdl, const Json::Value &jsonR
         Json::Value playParam = jsonRequest["param"];
         width = playParam["width"].asUInt();
         height = playParam["height"].asUInt();
+        if (playParam.isMember("fit")) {
+            fitMode = playParam["fit"].asInt();
+        }
     } catch (Json::Exception &e) {
         LOG_ERROR << "Parse Json Error:" << e.what();
         return InvalidJson;
@@ -166,25 +368,18 @@ int SignalSession::changeVideoResolution(uintptr_t hdl, const Json::Value &jsonR
     if (iter == mediaResourceManager_.end()) {
         return NoneError;
     }
+    if (!iter->second.ffmpegWrapper) {
+        return NotSupport;
+    }
+    if (fitMode >= 0 && iter->second.ffmpegWrapper->setFitMode(fitMode) != 0) {
+        return InvalidParameter;
+    }
     iter->second.ffmpegWrapper->changeVideoResolution(width, height);
     return NoneError;
 }
 
 int SignalSession::stopPlay(uintptr_t hdl, const Json::Value &jsonRequest) {
-    FfmpegWrapperPtr ffPtr;
-    {
-        std::lock_guard<std::mutex> lk(mu_);
-        auto iter = mediaResourceManager_.find(hdl);
-        if (iter == mediaResourceManager_.end()) {
-            return NoneError;
-        }
-
-        ffPtr = iter->second.ffmpegWrapper;
-        mediaResourceManager_.erase(iter);
-    }
-    if (ffPtr) {
-        ffPtr->stopPlay();
-    }
+    releaseResource(hdl);
     return NoneError;
 }
 
@@ -210,10 +405,262 @@ int SignalSession::discardFrame(uintptr_t hdl, const Json::Value &jsonRequest) {
     if (iter == mediaResourceManager_.end()) {
         return NoneError;
     }
-    iter->second.ffmpegWrapper->openDiscardFrames(enabled);
+    if (iter->second.compositor) {
+        iter->second.compositor->openDiscardFrames(enabled);
+    } else {
+        iter->second.ffmpegWrapper->openDiscardFrames(enabled);
+    }
     return NoneError;
 }
 
+int SignalSession::setCropRegion(uintptr_t hdl, const Json::Value &jsonRequest) {
+    double x = 0, y = 0, width = 0, height = 0;
+    try {
+        if (!jsonRequest.isMember("param")) {
+            return NotSupport;
+        }
+        Json::Value cropParam = jsonRequest["param"];
+        x = cropParam.get("x", 0).asDouble();
+        y = cropParam.get("y", 0).asDouble();
+        width = cropParam.get("width", 0).asDouble();
+        height = cropParam.get("height", 0).asDouble();
+    }
+    catch (Json::Exception &e) {
+        LOG_ERROR << "Parse Json Error:" << e.what();
+        return InvalidJson;
+    }
+
+    std::lock_guard<std::mutex> lk(mu_);
+    auto iter = mediaResourceManager_.find(hdl);
+    if (iter == mediaResourceManager_.end()) {
+        return NoneError;
+    }
+    if (!iter->second.ffmpegWrapper) {
+        return NotSupport;
+    }
+    if (iter->second.ffmpegWrapper->setCropRegion(x, y, width, height) != 0) {
+        return InvalidParameter;
+    }
+    return NoneError;
+}
+
+int SignalSession::resync(uintptr_t hdl) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto iter = mediaResourceManager_.find(hdl);
+    if (iter == mediaResourceManager_.end()) {
+        return NoneError;
+    }
+    if (iter->second.ffmpegWrapper) {
+        iter->second.ffmpegWrapper->requestFullFrame();
+    }
+    return NoneError;
+}
+
+// served from the latest decoded frame of the session, the image is returned base64 encoded
+int SignalSession::snapshot(uintptr_t hdl, const Json::Value &jsonRequest, Json::Value &responseBody) {
+    FfmpegWrapperPtr ffPtr;
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto iter = mediaResourceManager_.find(hdl);
+        if (iter == mediaResourceManager_.end()) {
+            return InvalidParameter;
+        }
+        if (!iter->second.ffmpegWrapper) {
+            return NotSupport;
+        }
+        ffPtr = iter->second.ffmpegWrapper;
+    }
+
+    int format = IMAGE_Jpeg;
+    int width = 0, height = 0, quality = 0;
+    if (jsonRequest.isMember("param")) {
+        const Json::Value &param = jsonRequest["param"];
+        std::string name = param.get("format", "jpeg").asString();
+        if (name == "png") {
+            format = IMAGE_Png;
+        } else if (name != "jpeg" && name != "jpg") {
+            return InvalidParameter;
+        }
+        width = param.get("width", 0).asInt();
+        height = param.get("height", 0).asInt();
+        quality = param.get("quality", 0).asInt();
+    }
+
+    // encoding runs outside mu_, the session keeps its wrapper alive through ffPtr
+    std::string image, mime;
+    int code = ffPtr->snapshot(format, width, height, quality, &image, &mime);
+    if (code == FFEncoderNotFound && format == IMAGE_Jpeg) {
+        LOG_WARN << "[" << hdl << "]no jpeg encoder, snapshot falls back to png";
+        code = ffPtr->snapshot(IMAGE_Png, width, height, quality, &image, &mime);
+    }
+    if (code != 0) {
+        return code < 0 ? PlayVideoError : code;
+    }
+
+    std::string encoded(AV_BASE64_SIZE(image.size()), '\0');
+    av_base64_encode(&encoded[0], (int)encoded.size(), (const uint8_t *)image.data(), (int)image.size());
+    encoded.resize(strlen(encoded.c_str()));
+    responseBody["mime"] = mime;
+    responseBody["image"] = encoded;
+    return NoneError;
+}
+
+// the wrapper of a single stream session, mosaic sessions have none
+SignalSession::FfmpegWrapperPtr SignalSession::findWrapper(uintptr_t hdl, int *code) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto iter = mediaResourceManager_.find(hdl);
+    if (iter == mediaResourceManager_.end()) {
+        *code = InvalidParameter;
+        return nullptr;
+    }
+    if (!iter->second.ffmpegWrapper) {
+        *code = NotSupport;
+        return nullptr;
+    }
+    *code = NoneError;
+    return iter->second.ffmpegWrapper;
+}
+
+int SignalSession::startRecord(uintptr_t hdl, const Json::Value &jsonRequest, Json::Value &responseBody) {
+    int code = NoneError;
+    FfmpegWrapperPtr ffPtr = findWrapper(hdl, &code);
+    if (!ffPtr) {
+        return code;
+    }
+
+    std::string name;
+    int segmentSeconds = 0, maxSegments = 0;
+    if (jsonRequest.isMember("param")) {
+        const Json::Value &param = jsonRequest["param"];
+        // only a plain directory name, never a path
+        for (char c : param.get("name", "").asString()) {
+            if (isalnum((unsigned char)c) || c == '_' || c == '-') {
+                name.push_back(c);
+            }
+        }
+        segmentSeconds = param.get("segment", 0).asInt();
+        maxSegments = param.get("segments", 0).asInt();
+    }
+    if (name.empty()) {
+        char stamp[32];
+        time_t now = time(nullptr);
+        strftime(stamp, sizeof(stamp), "%Y%m%d_%H%M%S", localtime(&now));
+        name = std::to_string(hdl) + "_" + stamp;
+    }
+
+    std::string dir = gConfig->recordPath + "/" + name;
+    if ((code = ffPtr->startRecord(dir, segmentSeconds, maxSegments)) != 0) {
+        return code;
+    }
+    responseBody["playlist"] = dir + "/index.m3u8";
+    responseBody["replay"] = dir + "/replay.m3u8";
+    return NoneError;
+}
+
+int SignalSession::stopRecord(uintptr_t hdl) {
+    int code = NoneError;
+    FfmpegWrapperPtr ffPtr = findWrapper(hdl, &code);
+    return ffPtr ? ffPtr->stopRecord() : code;
+}
+
+int SignalSession::pause(uintptr_t hdl, int paused) {
+    int code = NoneError;
+    FfmpegWrapperPtr ffPtr = findWrapper(hdl, &code);
+    return ffPtr ? ffPtr->pause(paused) : code;
+}
+
+int SignalSession::seek(uintptr_t hdl, const Json::Value &jsonRequest) {
+    int code = NoneError;
+    FfmpegWrapperPtr ffPtr = findWrapper(hdl, &code);
+    if (!ffPtr) {
+        return code;
+    }
+    if (!jsonRequest.isMember("param")) {
+        return InvalidParameter;
+    }
+    return ffPtr->seek(jsonRequest["param"].get("position", -1).asInt64());
+}
+
+int SignalSession::scrub(uintptr_t hdl, const Json::Value &jsonRequest) {
+    int code = NoneError;
+    FfmpegWrapperPtr ffPtr = findWrapper(hdl, &code);
+    if (!ffPtr) {
+        return code;
+    }
+    if (!jsonRequest.isMember("param")) {
+        return InvalidParameter;
+    }
+    const Json::Value &param = jsonRequest["param"];
+    return ffPtr->scrub(param.get("position", -1).asInt64(), param.get("done", 0).asInt());
+}
+
+int SignalSession::setRate(uintptr_t hdl, const Json::Value &jsonRequest) {
+    int code = NoneError;
+    FfmpegWrapperPtr ffPtr = findWrapper(hdl, &code);
+    if (!ffPtr) {
+        return code;
+    }
+    if (!jsonRequest.isMember("param")) {
+        return InvalidParameter;
+    }
+    return ffPtr->setRate(jsonRequest["param"].get("rate", 0).asDouble());
+}
+
+int SignalSession::switchInput(uintptr_t hdl, const Json::Value &jsonRequest) {
+    int code = NoneError;
+    FfmpegWrapperPtr ffPtr = findWrapper(hdl, &code);
+    if (!ffPtr) {
+        return code;
+    }
+    if (!jsonRequest.isMember("param")) {
+        return InvalidParameter;
+    }
+    const Json::Value &param = jsonRequest["param"];
+    std::string url = param["url"].asString();
+    if (url.empty()) {
+        return InvalidUrl;
+    }
+    uint16_t useTCP = 1;
+    if (param.isMember("use_tcp")) {
+        useTCP = param["use_tcp"].asUInt();
+    }
+    // the session keeps its url until the new input is installed, it may fail to open
+    return ffPtr->switchInput(url.c_str(), useTCP, [this, hdl, wrapper = ffPtr.get()](const std::string &url) {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto iter = mediaResourceManager_.find(hdl);
+        if (iter != mediaResourceManager_.end() && iter->second.ffmpegWrapper.get() == wrapper) {
+            iter->second.url = url;
+        }
+    });
+}
+
+// not bound to the connection, a preloaded url is played by whichever session asks for it first
+int SignalSession::preload(const Json::Value &jsonRequest) {
+    if (!jsonRequest.isMember("param")) {
+        return InvalidParameter;
+    }
+    const Json::Value &param = jsonRequest["param"];
+    if (!param["urls"].isArray() || param["urls"].empty()) {
+        return InvalidUrl;
+    }
+    uint16_t useTCP = 1;
+    if (param.isMember("use_tcp")) {
+        useTCP = param["use_tcp"].asUInt();
+    }
+    for (const auto &url : param["urls"]) {
+        if (url.asString().empty()) {
+            return InvalidUrl;
+        }
+    }
+    int code = NoneError;
+    for (const auto &url : param["urls"]) {
+        if ((code = StandbyPool::GetInstance().preload(url.asString(), useTCP)) != NoneError) {
+            break;
+        }
+    }
+    return code;
+}
+
 std::string SignalSession::getVersion() {
     return STRING_FULL_VERSION;
 }
@@ -5,6 +5,7 @@
 #include <cstdint>
 #include <map>
 #include "ffmpegWrapper.h"
+#include "mosaicCompositor.h"
 #include "webSocketServer.h"
 #include "error.h"
 #include "json.h"
@@ -17,6 +18,19 @@ typedef enum api_type {
     API_ChangeResolution,
     API_DiscardFrame,
     API_GetVersion,
+    API_SetCrop,
+    API_PlayMosaic,
+    API_Resync,
+    API_Snapshot,
+    API_StartRecord,
+    API_StopRecord,
+    API_Pause,
+    API_Resume,
+    API_Seek,
+    API_Scrub,
+    API_SetRate,
+    API_Switch,
+    API_Preload,
 
 } APIType;
 
@@ -24,6 +38,7 @@ class SignalSession : public ISession {
 public:
     using SignalSessionPtr = std::shared_ptr<SignalSession>;
     using FfmpegWrapperPtr = std::shared_ptr<FfmpegWrapper>;
+    using MosaicCompositorPtr = std::shared_ptr<MosaicCompositor>;
 
     ~SignalSession() override = default;
 
@@ -47,25 +62,59 @@ protected:
 
     int playVideo(WebsocketServer *ws, uintptr_t hdl, const Json::Value &jsonRequest);
 
+    int playMosaic(WebsocketServer *ws, uintptr_t hdl, const Json::Value &jsonRequest);
+
     int changeVideoResolution(uintptr_t hdl, const Json::Value &jsonRequest);
 
     int stopPlay(uintptr_t hdl, const Json::Value &jsonRequest);
 
     int discardFrame(uintptr_t hdl, const Json::Value &jsonRequest);
 
+    int setCropRegion(uintptr_t hdl, const Json::Value &jsonRequest);
+
+    int resync(uintptr_t hdl);
+
+    int snapshot(uintptr_t hdl, const Json::Value &jsonRequest, Json::Value &responseBody);
+
+    int startRecord(uintptr_t hdl, const Json::Value &jsonRequest, Json::Value &responseBody);
+
+    int stopRecord(uintptr_t hdl);
+
+    int pause(uintptr_t hdl, int paused);
+
+    int seek(uintptr_t hdl, const Json::Value &jsonRequest);
+
+    int scrub(uintptr_t hdl, const Json::Value &jsonRequest);
+
+    int setRate(uintptr_t hdl, const Json::Value &jsonRequest);
+
+    int switchInput(uintptr_t hdl, const Json::Value &jsonRequest);
+
+    int preload(const Json::Value &jsonRequest);
+
+    FfmpegWrapperPtr findWrapper(uintptr_t hdl, int *code);
+
     std::string getVersion();
 
 private:
     struct MediaResource {
         std::string url;
         FfmpegWrapperPtr ffmpegWrapper;
+        MosaicCompositorPtr compositor;     // set instead of ffmpegWrapper for a mosaic session
 
         MediaResource(std::string &&s, const FfmpegWrapperPtr &p) {
             url = std::move(s);
             ffmpegWrapper = p;
         }
+
+        MediaResource(std::string &&s, const MosaicCompositorPtr &p) {
+            url = std::move(s);
+            compositor = p;
+        }
     };
 
+    void releaseResource(uintptr_t hdl);
+
     SignalSession() = default;
 
     std::mutex mu_;
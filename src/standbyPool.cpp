@@ -0,0 +1,209 @@
+#include "standbyPool.h"
+#include <cstring>
+#include <algorithm>
+#include "ffmpegWrapper.h"
+#include "sessionReaper.h"
+#include "config.h"
+#include "error.h"
+#include "log.h"
+
+extern "C" {
+#include <libavutil/time.h>
+}
+
+// a preloaded live input nobody plays is closed after this long
+constexpr int64_t STANDBY_IDLE_US = 60 * 1000000LL;
+
+StandbyInput::~StandbyInput() {
+    for (AVPacket *pkt : packets) {
+        av_packet_free(&pkt);
+    }
+    avformat_close_input(&fmt_ctx);
+    mapped.reset();
+}
+
+StandbyPool &StandbyPool::GetInstance() {
+    static StandbyPool instance;
+    return instance;
+}
+
+StandbyPool::~StandbyPool() {
+    std::map<std::string, EntryPtr> entries;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        entries.swap(entries_);
+    }
+    for (auto &item : entries) {
+        item.second->cancel = true;
+    }
+    for (auto &item : entries) {
+        if (item.second->thread.joinable()) {
+            item.second->thread.join();
+        }
+    }
+}
+
+int StandbyPool::preload(const std::string &url, int useTCP) {
+    if (gConfig->standbyInputs <= 0) {
+        return NotSupport;
+    }
+    EntryPtr stale;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto iter = entries_.find(url);
+        if (iter != entries_.end()) {
+            // an input that failed or was closed for idleness is opened again
+            if (!iter->second->done || iter->second->input) {
+                iter->second->used_us = av_gettime_relative();
+                return NoneError;
+            }
+            stale = iter->second;
+            entries_.erase(iter);
+        }
+        EntryPtr entry = std::make_shared<Entry>();
+        entry->url = url;
+        entry->used_us = av_gettime_relative();
+        entry->thread = std::thread(&StandbyPool::standby, this, entry, useTCP);
+        entries_[url] = entry;
+    }
+    LOG_INFO << "preload url[" << url << "]";
+    if (stale) {
+        dispose(stale);
+    }
+    trim();
+    return NoneError;
+}
+
+std::unique_ptr<StandbyInput> StandbyPool::take(const std::string &url) {
+    EntryPtr entry;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto iter = entries_.find(url);
+        if (iter == entries_.end()) {
+            return nullptr;
+        }
+        entry = iter->second;
+        entries_.erase(iter);
+    }
+    entry->handover = true;
+    if (entry->thread.joinable()) {
+        entry->thread.join();
+    }
+    if (entry->input) {
+        // the entry goes with this function, the taker retargets the interrupt
+        entry->input->interrupt->retarget({ nullptr, nullptr });
+        LOG_INFO << "standby url[" << url << "] taken with " << entry->input->packets.size() << " packets";
+    }
+    return std::move(entry->input);
+}
+
+// thread of an entry. the packets are only touched here until the thread is joined.
+void StandbyPool::standby(EntryPtr entry, int useTCP) {
+    std::unique_ptr<StandbyInput> input(new StandbyInput());
+    input->url = entry->url;
+    AVPacket *pkt = nullptr;
+    bool ready = false;
+    input->interrupt->retarget({ interrupt_cb, entry.get() });
+    int ret = FfmpegWrapper::OpenInputUrl(entry->url.c_str(), useTCP, 1, input->interrupt->callback(),
+                                          &entry->deadline, &input->fmt_ctx, &input->mapped);
+    do {
+        if (ret != 0) {
+            break;
+        }
+        entry->deadline.arm(IoDeadline::IO_Probe);
+        if ((ret = avformat_find_stream_info(input->fmt_ctx, nullptr)) < 0) {
+            break;
+        }
+        if ((ret = input->video_index = av_find_best_stream(input->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0)) < 0) {
+            break;
+        }
+        if (!(pkt = av_packet_alloc())) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+
+        // files stop at their first keyframe, live inputs keep their latest GOP until taken
+        AVFormatContext *fmt_ctx = input->fmt_ctx;
+        bool live = !fmt_ctx->pb || !(fmt_ctx->pb->seekable & AVIO_SEEKABLE_NORMAL);
+        bool playlist = !strcmp(fmt_ctx->iformat->name, "hls");
+        while (!ready || (live && !entry->handover)) {
+            if (av_gettime_relative() - entry->used_us > STANDBY_IDLE_US && !entry->handover) {
+                ret = AVERROR(ETIMEDOUT);
+                break;
+            }
+            playlist ? entry->deadline.disarm() : entry->deadline.arm(IoDeadline::IO_Read);
+            if ((ret = av_read_frame(fmt_ctx, pkt)) < 0) {
+                break;
+            }
+            if (pkt->stream_index == input->video_index && (pkt->flags & AV_PKT_FLAG_KEY)) {
+                for (AVPacket *packet : input->packets) {
+                    av_packet_free(&packet);
+                }
+                input->packets.clear();
+                entry->bytes = 0;
+                if (!ready) {
+                    LOG_INFO << "standby url[" << entry->url << "] ready";
+                }
+                ready = true;
+            }
+            if (!ready) {
+                av_packet_unref(pkt);
+                continue;
+            }
+            entry->bytes += pkt->size;
+            input->packets.push_back(pkt);
+            if (!(pkt = av_packet_alloc())) {
+                ret = AVERROR(ENOMEM);
+                break;
+            }
+            trim();
+        }
+    } while (0);
+    av_packet_free(&pkt);
+
+    if (ready && ret >= 0) {
+        entry->input = std::move(input);
+    } else if (!entry->cancel) {
+        LOG_WARN << "standby url[" << entry->url << "] closed:" << av_err2str(ret);
+    }
+    entry->done = true;
+}
+
+void StandbyPool::trim() {
+    std::vector<EntryPtr> evicted;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        int64_t total = 0;
+        for (auto &item : entries_) {
+            total += item.second->bytes;
+        }
+        while (!entries_.empty() &&
+               ((int)entries_.size() > gConfig->standbyInputs || total > gConfig->standbyBytes)) {
+            auto oldest = std::min_element(entries_.begin(), entries_.end(), [](const auto &a, const auto &b) {
+                return a.second->used_us < b.second->used_us;
+            });
+            total -= oldest->second->bytes;
+            evicted.push_back(oldest->second);
+            entries_.erase(oldest);
+        }
+    }
+    for (auto &entry : evicted) {
+        LOG_INFO << "standby url[" << entry->url << "] evicted";
+        dispose(entry);
+    }
+}
+
+// the thread may be in a blocking read, it is joined off the caller's thread
+void StandbyPool::dispose(EntryPtr entry) {
+    entry->cancel = true;
+    SessionReaper::GetInstance().reap([entry]() {
+        if (entry->thread.joinable()) {
+            entry->thread.join();
+        }
+    });
+}
+
+int StandbyPool::interrupt_cb(void *ctx) {
+    Entry *entry = (Entry *)ctx;
+    return entry->cancel || entry->deadline.expired();
+}
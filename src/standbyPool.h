@@ -0,0 +1,80 @@
+#ifndef __STANDBY_POOL_H__
+#define __STANDBY_POOL_H__
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mappedInput.h"
+#include "ioDeadline.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+// An input opened and probed ahead of its session, with the packets read from its first
+// video keyframe on. Whoever takes it owns everything.
+struct StandbyInput {
+    std::string url;
+    AVFormatContext *fmt_ctx = nullptr;
+    std::unique_ptr<MappedInput> mapped;
+    std::unique_ptr<IoInterrupt> interrupt{ new IoInterrupt() };   // fmt_ctx is opened with it, outlives it
+    int video_index = -1;
+    std::vector<AVPacket *> packets;    // from the video keyframe on, every stream
+
+    ~StandbyInput();
+};
+
+// Inputs opened before they are played, e.g. the next cameras of a tour, so that Play or
+// Switch to them starts without the open and probe of the url. Live inputs are read on and
+// keep only their latest GOP, files stop at the first keyframe. The pool holds at most
+// gConfig->standbyInputs inputs and gConfig->standbyBytes of packets, the least recently
+// requested go first; an input nobody asks for again is closed after a while.
+class StandbyPool {
+public:
+    static StandbyPool &GetInstance();
+
+    // inputs still opening are given up
+    virtual ~StandbyPool();
+
+    // opens url in the background, a url already standing by is only marked as used
+    int preload(const std::string &url, int useTCP);
+
+    // the input of url, nullptr if there is none. an input that is still being opened is
+    // waited for, it is ahead of a new open anyway.
+    std::unique_ptr<StandbyInput> take(const std::string &url);
+
+private:
+    StandbyPool() = default;
+
+    struct Entry {
+        std::string url;
+        std::thread thread;
+        std::atomic<bool> cancel{ false };
+        std::atomic<bool> handover{ false };    // stop reading at the next packet, it is taken
+        std::atomic<int64_t> bytes{ 0 };
+        std::atomic<int64_t> used_us{ 0 };      // last preload of the url
+        std::atomic<bool> done{ false };
+        IoDeadline deadline;
+        std::unique_ptr<StandbyInput> input;    // set by the thread before done, nullptr if it failed
+    };
+    using EntryPtr = std::shared_ptr<Entry>;
+
+    void standby(EntryPtr entry, int useTCP);
+
+    // drops the least recently used entries beyond the limits
+    void trim();
+
+    static void dispose(EntryPtr entry);
+
+    static int interrupt_cb(void *ctx);
+
+private:
+    std::mutex mutex_;
+    std::map<std::string, EntryPtr> entries_;
+};
+
+#endif // __STANDBY_POOL_H__
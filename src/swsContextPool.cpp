@@ -0,0 +1,76 @@
+#include "swsContextPool.h"
+
+// enough for every tile of a 25-split layout plus the slice contexts of a 4K tile
+constexpr size_t SWS_POOL_MAX_IDLE = 64;
+
+bool SwsContextPool::Key::operator==(const Key &other) const {
+    return src_width == other.src_width && src_height == other.src_height && src_format == other.src_format &&
+           dst_width == other.dst_width && dst_height == other.dst_height && dst_format == other.dst_format &&
+           flags == other.flags;
+}
+
+void SwsContextPool::Releaser::operator()(struct SwsContext *ctx) const {
+    SwsContextPool::GetInstance().release(key, ctx);
+}
+
+SwsContextPool &SwsContextPool::GetInstance() {
+    static SwsContextPool instance;
+    return instance;
+}
+
+SwsContextPool::~SwsContextPool() {
+    for (auto &item: idle_) {
+        sws_freeContext(item.second);
+    }
+    idle_.clear();
+}
+
+SwsContextPool::SwsContextPtr SwsContextPool::acquire(const Key &key) {
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (auto it = idle_.begin(); it != idle_.end(); ++it) {
+            if (it->first == key) {
+                struct SwsContext *ctx = it->second;
+                idle_.erase(it);
+                return SwsContextPtr(ctx, Releaser{key});
+            }
+        }
+    }
+
+    struct SwsContext *ctx = sws_getContext(key.src_width, key.src_height, key.src_format,
+                                            key.dst_width, key.dst_height, key.dst_format,
+                                            key.flags, NULL, NULL, NULL);
+    return SwsContextPtr(ctx, Releaser{key});
+}
+
+// 放大用SWS_FAST_BILINEAR；缩小不到一半时用SWS_AREA，画质更好；
+// 缩小一半以上（多分屏的小画面）时用SWS_POINT，大图缩小时开销最小。
+int SwsContextPool::pickAlgorithm(int src_width, int src_height, int dst_width, int dst_height) {
+    if (dst_width == src_width && dst_height == src_height) {
+        return SWS_POINT;
+    }
+    if (dst_width > src_width || dst_height > src_height) {
+        return SWS_FAST_BILINEAR;
+    }
+    if (dst_width * 2 <= src_width && dst_height * 2 <= src_height) {
+        return SWS_POINT;
+    }
+    return SWS_AREA;
+}
+
+void SwsContextPool::release(const Key &key, struct SwsContext *ctx) {
+    if (!ctx) {
+        return;
+    }
+
+    struct SwsContext *evicted = nullptr;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        idle_.emplace_front(key, ctx);
+        if (idle_.size() > SWS_POOL_MAX_IDLE) {
+            evicted = idle_.back().second;
+            idle_.pop_back();
+        }
+    }
+    sws_freeContext(evicted);
+}
@@ -0,0 +1,59 @@
+#ifndef __SWS_CONTEXT_POOL_H__
+#define __SWS_CONTEXT_POOL_H__
+
+#include <list>
+#include <mutex>
+#include <memory>
+
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+// Process wide cache of scaler contexts, keyed by the complete conversion geometry.
+// A context is lent out for exclusive use and comes back when the returned pointer
+// is destroyed, so layout toggles and sessions with the same geometry reuse contexts
+// instead of paying sws_getContext every time.
+class SwsContextPool {
+public:
+    struct Key {
+        int src_width;
+        int src_height;
+        enum AVPixelFormat src_format;
+        int dst_width;
+        int dst_height;
+        enum AVPixelFormat dst_format;
+        int flags;
+
+        bool operator==(const Key &other) const;
+    };
+
+    struct Releaser {
+        Key key;
+
+        void operator()(struct SwsContext *ctx) const;
+    };
+
+    using SwsContextPtr = std::unique_ptr<struct SwsContext, Releaser>;
+
+    static SwsContextPool &GetInstance();
+
+    virtual ~SwsContextPool();
+
+    // empty pointer if the conversion is not supported
+    SwsContextPtr acquire(const Key &key);
+
+    // scale algorithm for a conversion, chosen by scale ratio
+    static int pickAlgorithm(int src_width, int src_height, int dst_width, int dst_height);
+
+private:
+    SwsContextPool() = default;
+
+    void release(const Key &key, struct SwsContext *ctx);
+
+private:
+    std::mutex mutex_;
+    // most recently released first
+    std::list<std::pair<Key, struct SwsContext *>> idle_;
+};
+
+#endif // __SWS_CONTEXT_POOL_H__
@@ -0,0 +1,115 @@
+#include "threadPool.h"
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include "config.h"
+
+ThreadPool &ThreadPool::GetInstance() {
+    // hardware_concurrency may be 0, posted tasks (repaints) are waited for and need a worker
+    static ThreadPool instance(gConfig->workerThreads > 0
+                               ? gConfig->workerThreads
+                               : std::max(1, (int) std::thread::hardware_concurrency()));
+    return instance;
+}
+
+ThreadPool::ThreadPool(int threads) : stop_request_(false), reserved_(0) {
+    for (int i = 0; i < threads; i++) {
+        workers_.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stop_request_ = true;
+    }
+    cond_.notify_all();
+    for (auto &t: workers_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(int jobs, const std::function<void(int)> &fn) {
+    struct Batch {
+        std::atomic<int> next{0};
+        int done = 0;
+        std::mutex mutex;
+        std::condition_variable cond;
+    };
+    auto batch = std::make_shared<Batch>();
+    const std::function<void(int)> *job = &fn;
+
+    // whoever claims an index runs it, workers that arrive late find nothing left.
+    // fn is only touched for claimed indexes, all of which finish before we return.
+    auto drain = [batch, job, jobs]() {
+        int i;
+        while ((i = batch->next++) < jobs) {
+            (*job)(i);
+            std::lock_guard<std::mutex> lk(batch->mutex);
+            if (++batch->done == jobs) {
+                batch->cond.notify_all();
+            }
+        }
+    };
+
+    int helpers = std::min(jobs - 1, available());
+    if (helpers > 0) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (int i = 0; i < helpers; i++) {
+            tasks_.emplace_back(drain);
+        }
+    }
+    cond_.notify_all();
+
+    drain();
+
+    std::unique_lock<std::mutex> lk(batch->mutex);
+    batch->cond.wait(lk, [&]() { return batch->done == jobs; });
+}
+
+void ThreadPool::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        tasks_.emplace_back(std::move(task));
+    }
+    cond_.notify_one();
+}
+
+int ThreadPool::size() const {
+    return (int) workers_.size();
+}
+
+int ThreadPool::available() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return std::max(0, size() - reserved_);
+}
+
+int ThreadPool::reserve(int threads) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    int granted = std::max(0, std::min(threads, size() - reserved_));
+    reserved_ += granted;
+    return granted;
+}
+
+void ThreadPool::unreserve(int threads) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    reserved_ = std::max(0, reserved_ - threads);
+}
+
+void ThreadPool::worker() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            cond_.wait(lk, [this]() { return stop_request_ || !tasks_.empty(); });
+            if (stop_request_ && tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
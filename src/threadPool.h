@@ -0,0 +1,52 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+// Worker threads shared by all sessions, so that the number of threads stays
+// bounded no matter how many streams are playing.
+class ThreadPool {
+public:
+    static ThreadPool &GetInstance();
+
+    virtual ~ThreadPool();
+
+    // run fn(0) ... fn(jobs - 1) in parallel and wait until all of them are done.
+    // the calling thread takes part, so it never waits on a busy pool.
+    void parallelFor(int jobs, const std::function<void(int)> &fn);
+
+    // run task on a worker some time later, for short jobs that must not block the caller
+    void post(std::function<void()> task);
+
+    int size() const;
+
+    // workers not reserved, parallel work fans out to at most this many
+    int available();
+
+    // Components that run their own threads (e.g. encoders) reserve them from the same
+    // budget as the pool workers. returns how many of the wanted threads were granted,
+    // possibly 0; every grant must be given back with unreserve.
+    int reserve(int threads);
+
+    void unreserve(int threads);
+
+private:
+    explicit ThreadPool(int threads);
+
+    void worker();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> workers_;
+    bool stop_request_;
+    int reserved_;
+};
+
+#endif // __THREAD_POOL_H__
@@ -0,0 +1,164 @@
+#include "tsWriter.h"
+#include <cstring>
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/crc.h>
+#include <libavutil/bswap.h>
+#include <libavutil/intreadwrite.h>
+}
+
+constexpr int TS_PACKET_SIZE = 188;
+constexpr int TS_PAYLOAD_SIZE = 184;
+constexpr int TS_PID_PAT = 0x0000;
+constexpr int TS_PID_PMT = 0x1000;
+constexpr int TS_PID_VIDEO = 0x0100;
+constexpr int TS_PROGRAM_NUMBER = 1;
+constexpr uint8_t TS_STREAM_TYPE_H264 = 0x1b;
+constexpr uint8_t TS_STREAM_TYPE_HEVC = 0x24;
+constexpr uint8_t PES_STREAM_ID_VIDEO = 0xe0;
+
+TsWriter::TsWriter(enum AVCodecID codec_id) : codec_id_(codec_id), cc_pat_(0), cc_pmt_(0), cc_video_(0) {
+}
+
+bool TsWriter::Supports(enum AVCodecID codec_id) {
+    return codec_id == AV_CODEC_ID_H264 || codec_id == AV_CODEC_ID_HEVC;
+}
+
+// avcC/hvcC inputs (mp4, flv) are converted, inputs that are Annex-B already (rtsp, ts) only
+// get the extradata repeated.
+const char *TsWriter::AnnexBFilters(const AVCodecParameters *par) {
+    bool annexb = par->extradata_size >= 4 &&
+        (AV_RB32(par->extradata) == 1 || AV_RB24(par->extradata) == 1);
+    if (par->codec_id == AV_CODEC_ID_H264) {
+        return (par->extradata_size > 0 && !annexb) ? "h264_mp4toannexb" : "dump_extra=freq=keyframe";
+    } else if (par->codec_id == AV_CODEC_ID_HEVC) {
+        return (par->extradata_size > 0 && !annexb) ? "hevc_mp4toannexb" : "dump_extra=freq=keyframe";
+    }
+    return nullptr;
+}
+
+// section holds the complete section with 4 bytes left for the CRC
+void TsWriter::write_section(int pid, uint8_t *section, int size, std::string *out) {
+    uint32_t crc = av_bswap32(av_crc(av_crc_get_table(AV_CRC_32_IEEE), UINT32_MAX, section, size - 4));
+    AV_WB32(section + size - 4, crc);
+
+    uint8_t packet[TS_PACKET_SIZE];
+    memset(packet, 0xff, sizeof(packet));
+    uint8_t &cc = pid == TS_PID_PAT ? cc_pat_ : cc_pmt_;
+    packet[0] = 0x47;
+    packet[1] = (uint8_t)(0x40 | (pid >> 8));
+    packet[2] = (uint8_t)pid;
+    packet[3] = (uint8_t)(0x10 | (cc++ & 0x0f));
+    packet[4] = 0;  // pointer field
+    memcpy(packet + 5, section, size);
+    out->append((const char *)packet, sizeof(packet));
+}
+
+void TsWriter::writeTables(std::string *out) {
+    uint8_t pat[16] = {
+        0x00, 0xb0, 13,                             // table id, section length
+        0x00, 0x01, 0xc1, 0x00, 0x00,               // transport stream id, version 0, current
+        0x00, TS_PROGRAM_NUMBER,
+        (uint8_t)(0xe0 | (TS_PID_PMT >> 8)), (uint8_t)TS_PID_PMT,
+    };
+    write_section(TS_PID_PAT, pat, sizeof(pat), out);
+
+    uint8_t pmt[21] = {
+        0x02, 0xb0, 18,
+        0x00, TS_PROGRAM_NUMBER, 0xc1, 0x00, 0x00,
+        (uint8_t)(0xe0 | (TS_PID_VIDEO >> 8)), (uint8_t)TS_PID_VIDEO,     // PCR pid
+        0xf0, 0x00,                                                         // program info length
+        codec_id_ == AV_CODEC_ID_HEVC ? TS_STREAM_TYPE_HEVC : TS_STREAM_TYPE_H264,
+        (uint8_t)(0xe0 | (TS_PID_VIDEO >> 8)), (uint8_t)TS_PID_VIDEO,
+        0xf0, 0x00,                                                         // es info length
+    };
+    write_section(TS_PID_PMT, pmt, sizeof(pmt), out);
+}
+
+static uint8_t *put_timestamp(uint8_t *p, int prefix, int64_t ts) {
+    p[0] = (uint8_t)((prefix << 4) | ((ts >> 29) & 0x0e) | 1);
+    AV_WB16(p + 1, (uint16_t)(((ts >> 14) & 0xfffe) | 1));
+    AV_WB16(p + 3, (uint16_t)(((ts << 1) & 0xfffe) | 1));
+    return p + 5;
+}
+
+// Every frame is one PES packet. The first TS packet of a frame carries the PCR (taken from the
+// dts) and the random access flag on keyframes, the last one is padded by the adaptation field.
+void TsWriter::writeFrame(const uint8_t *data, int size, int64_t pts, int64_t dts, bool key, std::string *out) {
+    pts &= 0x1ffffffffLL;
+    dts &= 0x1ffffffffLL;
+    uint8_t pes[19];
+    bool has_dts = dts != pts;
+    pes[0] = 0x00;
+    pes[1] = 0x00;
+    pes[2] = 0x01;
+    pes[3] = PES_STREAM_ID_VIDEO;
+    pes[4] = 0x00;      // unbounded length, allowed for video
+    pes[5] = 0x00;
+    pes[6] = 0x80;
+    pes[7] = has_dts ? 0xc0 : 0x80;
+    pes[8] = has_dts ? 10 : 5;
+    uint8_t *p = put_timestamp(pes + 9, has_dts ? 3 : 2, pts);
+    if (has_dts) {
+        p = put_timestamp(p, 1, dts);
+    }
+    int pes_header_size = (int)(p - pes);
+
+    int total = pes_header_size + size;
+    int pos = 0;
+    bool first = true;
+    while (pos < total) {
+        uint8_t packet[TS_PACKET_SIZE];
+        uint8_t *af = packet + 4;
+        int af_len = -1;    // value of the adaptation field length byte, -1 without the field
+        if (first) {
+            af[1] = (uint8_t)(0x10 | (key ? 0x40 : 0));     // PCR, random access
+            af[2] = (uint8_t)(dts >> 25);
+            af[3] = (uint8_t)(dts >> 17);
+            af[4] = (uint8_t)(dts >> 9);
+            af[5] = (uint8_t)(dts >> 1);
+            af[6] = (uint8_t)(((dts & 1) << 7) | 0x7e);
+            af[7] = 0;
+            af_len = 7;
+        }
+        int used = af_len >= 0 ? af_len + 1 : 0;
+        int payload = std::min(total - pos, TS_PAYLOAD_SIZE - used);
+        int stuffing = TS_PAYLOAD_SIZE - used - payload;
+        if (stuffing > 0 && af_len < 0) {
+            af_len = 0;
+            stuffing--;
+            if (stuffing > 0) {
+                af[1] = 0;
+                af_len = 1;
+                stuffing--;
+            }
+        }
+        if (stuffing > 0) {
+            memset(af + 1 + af_len, 0xff, stuffing);
+            af_len += stuffing;
+        }
+        if (af_len >= 0) {
+            af[0] = (uint8_t)af_len;
+        }
+
+        packet[0] = 0x47;
+        packet[1] = (uint8_t)((first ? 0x40 : 0) | (TS_PID_VIDEO >> 8));
+        packet[2] = (uint8_t)TS_PID_VIDEO;
+        packet[3] = (uint8_t)((af_len >= 0 ? 0x30 : 0x10) | (cc_video_++ & 0x0f));
+
+        uint8_t *dst = packet + 4 + (af_len >= 0 ? af_len + 1 : 0);
+        int n = payload;
+        if (pos < pes_header_size) {
+            int header = std::min(pes_header_size - pos, n);
+            memcpy(dst, pes + pos, header);
+            dst += header;
+            n -= header;
+            pos += header;
+        }
+        memcpy(dst, data + (pos - pes_header_size), n);
+        pos += n;
+        out->append((const char *)packet, sizeof(packet));
+        first = false;
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef __TS_WRITER_H__
+#define __TS_WRITER_H__
+
+#include <string>
+#include <cstdint>
+
+extern "C" {
+#include <libavcodec/codec_par.h>
+}
+
+// Minimal MPEG-TS packetizer for one H.264/H.265 video stream in Annex-B, enough for the
+// recordings to be played back by FFmpeg's mpegts/hls demuxers. The bundled FFmpeg is
+// built without muxers, so this does not go through libavformat.
+class TsWriter {
+public:
+    explicit TsWriter(enum AVCodecID codec_id);
+
+    static bool Supports(enum AVCodecID codec_id);
+
+    // bitstream filters that turn packets of par into Annex-B with the parameter sets in front
+    // of every keyframe, nullptr if the codec is not supported
+    static const char *AnnexBFilters(const AVCodecParameters *par);
+
+    // PAT and PMT, written at the start of every segment
+    void writeTables(std::string *out);
+
+    // one access unit, pts/dts in 90 kHz
+    void writeFrame(const uint8_t *data, int size, int64_t pts, int64_t dts, bool key, std::string *out);
+
+private:
+    void write_section(int pid, uint8_t *section, int size, std::string *out);
+
+private:
+    enum AVCodecID codec_id_;
+    uint8_t cc_pat_;
+    uint8_t cc_pmt_;
+    uint8_t cc_video_;
+};
+
+#endif // __TS_WRITER_H__
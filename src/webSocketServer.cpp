@@ -13,6 +13,8 @@ WebsocketServer::WebsocketServer(ISession *ptr) {
 }
 
 void WebsocketServer::init() {
+    msgManager_ = websocketpp::lib::make_shared<ServerConfig::con_msg_manager_type>();
+
 // Set logging settings
     endpoint_.set_error_channels(websocketpp::log::elevel::fatal);
     endpoint_.set_max_message_size(3 * 32000000);
@@ -124,6 +126,10 @@ void WebsocketServer::onClose(WebsocketCon hdl) {
 }
 
 int WebsocketServer::Send(uintptr_t key, uint8_t *buf, unsigned int len, OpCode code) {
+    return Send(key, std::string((const char *) buf, len), code);
+}
+
+int WebsocketServer::Send(uintptr_t key, std::string &&payload, OpCode code) {
     try {
         websocketpp::lib::error_code err;
         WebsocketCon hdl;
@@ -138,11 +144,20 @@ int WebsocketServer::Send(uintptr_t key, uint8_t *buf, unsigned int len, OpCode
         }
 
         Server::connection_ptr con = endpoint_.get_con_from_hdl(hdl);
-        while (con->get_buffered_amount() > 0 && buf[0] == 0x1) {
+        while (con->get_buffered_amount() > 0 && !payload.empty() && payload[0] == 0x1) {
             return WSSendBufferOverflow;
         }
 
-        endpoint_.send(hdl, buf, len, code, err);
+        // the frame header is prepared here, so the connection queues the message as it is
+        // instead of copying the payload into another message.
+        Server::message_ptr msg = msgManager_->get_message(code, 0);
+        msg->get_raw_payload().swap(payload);
+        websocketpp::frame::basic_header header(code, msg->get_payload().size(), true, false);
+        websocketpp::frame::extended_header extHeader(msg->get_payload().size());
+        msg->set_header(websocketpp::frame::prepare_header(header, extHeader));
+        msg->set_prepared(true);
+
+        endpoint_.send(hdl, msg, err);
         if (err) {
             LOG_ERROR << "send error " << err.value() << "(" << err.message() << ")";
             return -1;
@@ -8,8 +8,51 @@
 
 #include <shared_mutex>
 #include <functional>
+#include "bufferPool.h"
 
-typedef websocketpp::server<websocketpp::config::asio> Server;
+// Connection message manager whose messages hand their payload storage back to
+// BufferPool when they are released, instead of freeing it.
+template <typename message>
+class PooledMsgManager : public websocketpp::lib::enable_shared_from_this<PooledMsgManager<message> > {
+public:
+    typedef PooledMsgManager<message> type;
+    typedef websocketpp::lib::shared_ptr<PooledMsgManager> ptr;
+    typedef websocketpp::lib::weak_ptr<PooledMsgManager> weak_ptr;
+    typedef typename message::ptr message_ptr;
+
+    message_ptr get_message() {
+        return message_ptr(new message(type::shared_from_this()), &type::release);
+    }
+
+    message_ptr get_message(websocketpp::frame::opcode::value op, size_t size) {
+        message_ptr msg(new message(type::shared_from_this(), op, 0), &type::release);
+        std::string &payload = msg->get_raw_payload();
+        payload = BufferPool::GetInstance().acquire(size);
+        payload.clear();
+        return msg;
+    }
+
+    bool recycle(message *) {
+        return false;
+    }
+
+private:
+    static void release(message *msg) {
+        BufferPool::GetInstance().release(std::move(msg->get_raw_payload()));
+        delete msg;
+    }
+};
+
+struct ServerConfig : public websocketpp::config::asio {
+    typedef ServerConfig type;
+
+    typedef websocketpp::message_buffer::message<PooledMsgManager> message_type;
+    typedef PooledMsgManager<message_type> con_msg_manager_type;
+    typedef websocketpp::message_buffer::alloc::endpoint_msg_manager<con_msg_manager_type>
+            endpoint_msg_manager_type;
+};
+
+typedef websocketpp::server<ServerConfig> Server;
 using WebsocketCon = websocketpp::connection_hdl;
 
 class ISession;
@@ -26,6 +69,9 @@ public:
 
     int Send(uintptr_t key, uint8_t *buf, unsigned int len, OpCode code = OpCode::binary);
 
+    // payload is moved into the outgoing message without copying, prefer BufferPool storage.
+    int Send(uintptr_t key, std::string &&payload, OpCode code = OpCode::binary);
+
     void Run(int port);
 
 protected:
@@ -41,6 +87,7 @@ protected:
 
 private:
     Server endpoint_;
+    ServerConfig::con_msg_manager_type::ptr msgManager_;
 
     std::shared_mutex mutex_;
     std::map<uintptr_t, WebsocketCon> mapConnection_;